@@ -0,0 +1,69 @@
+#!/bin/bash
+#
+# Benchmark bl_server with bl_bench. Each configuration starts a fresh
+# server, drives it with bl_bench and prints the throughput and latency
+# bl_bench measured along with the server's STATS lines (system calls
+# per message and how many message buffers came from the heap) printed
+# at shutdown. Broadcasts are written one at a time and then batched
+# (BL_BATCH) per pass of the server's loop and over a 1 ms window,
+# trading latency for fewer writes. With BL_ADVANCED the server also
+# logs, first as plain records and then as compressed blocks (BL_LOGZ),
+# and reports how much each format stores and how fast it is written,
+# and once more with the %search index (BL_SEARCH) to time queries
+# against the messages just sent and report the size of the index.
+# Then the same clients are spread over federated rooms of 1, 2 and 4
+# servers (see fed_funcs.c) to show how throughput grows as servers
+# share the work of delivering to them.
+#
+# usage: ./bench_blather.sh [clients] [messages per client]
+
+clients=${1:-16}
+mesgs=${2:-2000}
+server="bench-serv"
+
+function bench_run () {                    # bench_run <label> <env settings...>
+    label=$1
+    shift
+    printf "== %s\n" "$label"
+    rm -f ${server}.*
+    env BL_NOLOG=1 BL_STATS=1 "$@" ./bl_server $server 2> ${server}.err & server_pid=$!
+    sleep 0.2
+    ./bl_bench $server $clients $mesgs ${searches:-0}
+    sleep 0.2
+    kill $server_pid
+    wait $server_pid
+    grep '^STATS' ${server}.err
+    rm -f ${server}.*
+}
+
+bench_run "poll backend" BL_IO=poll
+bench_run "io_uring backend" BL_IO=uring
+bench_run "batched per pass" BL_BATCH=0
+bench_run "batched over 1000 usec" BL_BATCH=1000
+bench_run "batched per pass, io_uring" BL_IO=uring BL_BATCH=0
+bench_run "plain log" BL_ADVANCED=1
+bench_run "compressed log" BL_ADVANCED=1 BL_LOGZ=1
+searches=200 bench_run "search index" BL_ADVANCED=1 BL_SEARCH=1
+
+function fed_run () {                      # fed_run <servers>
+    n=$1
+    printf "== federation of %d server(s)\n" $n
+    rm -f ${server}*.*
+    env BL_NOLOG=1 BL_FEDERATE=leader ./bl_server $server & pids=$!
+    names=$server
+    sleep 0.2
+    for ((k = 1; k < n; k++)); do
+        env BL_NOLOG=1 BL_FEDERATE=$server ./bl_server $server$k & pids="$pids $!"
+        names="$names,$server$k"
+    done
+    sleep 0.2
+    ./bl_bench $names $clients $mesgs
+    sleep 0.2
+    kill $pids
+    wait $pids
+    rm -f ${server}*.*
+}
+
+for n in 1 2 4; do
+    fed_run $n
+done
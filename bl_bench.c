@@ -0,0 +1,217 @@
+#include "blather.h"
+
+// bl_bench: drive a running bl_server with many clients sending as
+// fast as the server will take messages and report throughput and
+// how long broadcasts took to reach the clients.
+//
+// usage: bl_bench <server name>[,<server name>...] <clients> <messages per client> [searches]
+//
+// All clients live in this one process. Input from the server is
+// drained while sending so that neither side blocks on a full FIFO.
+// Given several servers of a federated room (see fed_funcs.c), the
+// clients are spread across them in turn.
+//
+// Given a number of searches, the first client then sends that many
+// "%search" commands for messages sent earlier, one at a time, and
+// reports how long the server took to answer them (see
+// search_funcs.c). The server must run with BL_SEARCH.
+
+typedef struct {
+  int sendfd;                   // to_server FIFO
+  int recvfd;                   // to_client FIFO
+  join_t join;                  // request used to join, holds the FIFO names
+  char buf[CATCHUP_BUF];        // bytes read from the server not yet decoded
+  int len;                      // number of bytes in buf
+  long received;                // BL_MESG messages received
+  long latency;                 // total microseconds from their broadcast to their receipt
+  long worst;                   // longest of those
+  char known[MAXCLIENTS];       // flags: session ids named by BL_JOINED or BL_NAMEMAP
+  int n_known;                  // number of flags set in known
+  long found;                   // BL_FOUND messages received for %search
+  long answered;                // %search commands answered, by a BL_FOUND with no name
+  char want[MAXLINE];           // body of the message the last %search was for
+  int saw_want;                 // flag: the last %search returned that message
+} bench_client_t;
+
+static bench_client_t *clients;
+static int n_clients;
+
+// Read everything available from the server for client c, answering
+// pings. Returns the number of messages decoded.
+static int bench_drain(bench_client_t *c) {
+  int count = 0;
+  while (1) {
+    int bytes = read(c->recvfd, c->buf + c->len, CATCHUP_BUF - c->len);
+    if (bytes <= 0)
+      break;
+    c->len += bytes;
+    long now = clock_usec();
+    int pos = 0, ret;
+    mesg_t msg;
+    while ((ret = mesg_decode(c->buf + pos, c->len - pos, &msg)) > 0) {
+      pos += ret;
+      count++;
+      if (msg.kind == BL_MESG) {
+        c->received++;
+        c->latency += now - msg.tstamp;
+        c->worst = now - msg.tstamp > c->worst ? now - msg.tstamp : c->worst;
+      }
+      else if (msg.kind == BL_FOUND && msg.name[0] == '\0')
+        c->answered++;
+      else if (msg.kind == BL_FOUND) {
+        c->found++;
+        if (strcmp(msg.body, c->want) == 0)
+          c->saw_want = 1;
+      }
+      else if ((msg.kind == BL_JOINED || msg.kind == BL_NAMEMAP) && msg.name_id >= 0 && msg.name_id < MAXCLIENTS
+               && !c->known[msg.name_id]) {
+        c->known[msg.name_id] = 1;
+        c->n_known++;
+      }
+      else if (msg.kind == BL_PING) {
+        mesg_t pong = {
+          .kind = BL_PING,
+          .name_id = NOID,
+        };
+        mesg_write(c->sendfd, &pong);
+      }
+    }
+    check_fail(ret < 0, 0, "bl_bench: garbled message from server\n");
+    memmove(c->buf, c->buf + pos, c->len - pos);
+    c->len -= pos;
+  }
+  return count;
+}
+
+// Wait for and drain input from the server on all clients.
+static void bench_poll(int timeout_ms) {
+  struct pollfd pfds[MAXCLIENTS];
+  for (int i = 0; i < n_clients; i++) {
+    pfds[i].fd = clients[i].recvfd;
+    pfds[i].events = POLLIN;
+  }
+  if (poll(pfds, n_clients, timeout_ms) <= 0)
+    return;
+  for (int i = 0; i < n_clients; i++) {
+    if (pfds[i].revents & POLLIN)
+      bench_drain(&clients[i]);
+  }
+}
+
+// Send "%search" for message m of client i from the first client and
+// wait for the answer. Returns the microseconds taken and sets
+// *saw to whether the message was among those found.
+static long bench_search(long m, int i, int *saw) {
+  bench_client_t *c = &clients[0];
+  mesg_t msg = {
+    .kind = BL_MESG,
+    .name_id = NOID,
+  };
+  snprintf(msg.body, MAXLINE, "%%search message %ld client %d", m, i);
+  snprintf(c->want, MAXLINE, "bench message %ld from client %d", m, i);
+  c->saw_want = 0;
+  long answered = c->answered;
+  long start = clock_usec();
+  check_fail(mesg_write(c->sendfd, &msg) != 0, 1, "bl_bench: couldn't send\n");
+  while (c->answered == answered)
+    bench_poll(100);
+  *saw = c->saw_want;
+  return clock_usec() - start;
+}
+
+int main(int argc, char **argv) {
+  check_fail(argc < 4, 0, "usage: %s <server name>[,<server name>...] <clients> <messages per client> [searches]\n", argv[0]);
+  char *servers[MAXPEERS+1];
+  int n_servers = 0;
+  for (char *name = strtok(argv[1], ","); name != NULL && n_servers <= MAXPEERS; name = strtok(NULL, ","))
+    servers[n_servers++] = name;
+  check_fail(n_servers == 0, 0, "bl_bench: no server named\n");
+  n_clients = atoi(argv[2]);
+  long n_mesgs = atol(argv[3]);
+  check_fail(n_clients < 1 || n_clients > MAXCLIENTS, 0, "bl_bench: 1 to %d clients\n", MAXCLIENTS);
+  clients = calloc(n_clients, sizeof(bench_client_t));
+  check_fail(clients == NULL, 1, "bl_bench: couldn't allocate clients\n");
+
+  for (int i = 0; i < n_clients; i++) {
+    bench_client_t *c = &clients[i];
+    joinrec_t rec = { .last_seq = 0 };
+    snprintf(rec.name, MAXNAME, "bench%d", i);
+    snprintf(rec.fifo_prefix, JOINQ_PREFIX, "%d.%d", getpid(), i);
+    joinq_to_join(&rec, &c->join);
+    mkfifo(c->join.to_client_fname, S_IRUSR | S_IWUSR);
+    mkfifo(c->join.to_server_fname, S_IRUSR | S_IWUSR);
+    c->recvfd = open(c->join.to_client_fname, O_RDWR | O_NONBLOCK);
+    c->sendfd = open(c->join.to_server_fname, O_RDWR | O_NONBLOCK);
+    check_fail(c->recvfd == -1 || c->sendfd == -1, 1, "bl_bench: couldn't open client FIFOs\n");
+    char *server = servers[i % n_servers];
+    check_fail(joinq_join(server, &rec) != 0, 1, "bl_bench: couldn't join %s\n", server);
+  }
+  // everyone is in once every client has been told of all the others
+  for (int i = 0; i < n_clients; i++) {
+    while (clients[i].n_known < n_clients)
+      bench_poll(100);
+  }
+
+  long start = clock_usec();
+  mesg_t msg = {
+    .kind = BL_MESG,
+    .name_id = NOID,
+  };
+  for (long m = 0; m < n_mesgs; m++) {
+    for (int i = 0; i < n_clients; i++) {
+      snprintf(msg.body, MAXLINE, "bench message %ld from client %d", m, i);
+      while (mesg_write(clients[i].sendfd, &msg) != 0) {
+        check_fail(errno != EAGAIN, 1, "bl_bench: couldn't send\n");
+        bench_poll(10); // server is behind; take its output so it can catch up
+      }
+    }
+    bench_poll(0);
+  }
+  long expect = n_mesgs * n_clients;
+  for (int i = 0; i < n_clients; i++) {
+    while (clients[i].received < expect)
+      bench_poll(100);
+  }
+  long usec = clock_usec() - start;
+
+  printf("%d clients on %d server%s x %ld messages: %ld messages, %ld deliveries in %.3f s\n",
+         n_clients, n_servers, n_servers > 1 ? "s" : "", n_mesgs, expect, expect * n_clients, usec / 1e6);
+  printf("throughput: %.0f messages/s, %.0f deliveries/s\n",
+         expect / (usec / 1e6), expect * n_clients / (usec / 1e6));
+  long latency = 0, latency_worst = 0;
+  for (int i = 0; i < n_clients; i++) {
+    latency += clients[i].latency;
+    latency_worst = clients[i].worst > latency_worst ? clients[i].worst : latency_worst;
+  }
+  printf("latency: %.0f usec average, %ld usec worst from broadcast to receipt\n",
+         expect ? (double) latency / (expect * n_clients) : 0.0, latency_worst);
+
+  int n_searches = argc > 4 ? atoi(argv[4]) : 0;
+  if (n_searches > 0 && n_mesgs > 0) {
+    // the server indexes in the background; wait until the last message is searchable
+    int saw = 0;
+    for (long waited = 0; !saw && waited < 5000000; )
+      waited += bench_search(n_mesgs - 1, n_clients - 1, &saw);
+    long total = 0, worst = 0, hits = 0;
+    srand(1);
+    for (int k = 0; k < n_searches; k++) {
+      long t = bench_search(rand() % n_mesgs, rand() % n_clients, &saw);
+      total += t;
+      worst = t > worst ? t : worst;
+      hits += saw;
+    }
+    printf("search: %d queries over %ld messages, %.0f usec average, %ld usec worst, %ld found their message\n",
+           n_searches, expect, (double) total / n_searches, worst, hits);
+  }
+
+  msg.kind = BL_DEPARTED;
+  for (int i = 0; i < n_clients; i++) {
+    mesg_write(clients[i].sendfd, &msg);
+    close(clients[i].sendfd);
+    close(clients[i].recvfd);
+    unlink(clients[i].join.to_client_fname);
+    unlink(clients[i].join.to_server_fname);
+  }
+  free(clients);
+  return 0;
+}
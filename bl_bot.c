@@ -0,0 +1,72 @@
+#include "blather.h"
+
+// bl_bot: sample bot built on libblather_client. Joins a server, sends
+// messages as fast as the server takes them while answering anyone who
+// says "!stats" with its counts, and reports its rate when done.
+//
+// usage: bl_bot <server name> <bot name> [messages to send]
+//
+// Everything runs in one thread around a poll() loop and messages are
+// taken with the callback interface, blclient_dispatch().
+
+typedef struct {
+  long sent;                    // messages queued for the server
+  long echoed;                  // this bot's messages broadcast back to it
+  long received;                // all chat messages received
+  long missed;                  // broadcasts lost in gaps of the sequence numbers
+  char name[MAXNAME];           // name the bot joined as
+} bot_t;
+
+// Callback for each message from the server.
+static void bot_handle(blclient_t *c, mesg_t *msg, void *arg) {
+  bot_t *bot = arg;
+  bot->missed += c->missed;
+  if (msg->kind != BL_MESG)
+    return;
+  bot->received++;
+  if (strcmp(msg->name, bot->name) == 0 && strncmp(msg->body, "message ", 8) == 0) {
+    bot->echoed++;
+  } else if (strncmp(msg->body, "!stats", 6) == 0) {
+    char reply[MAXLINE];
+    snprintf(reply, MAXLINE, "%s: sent %ld, received %ld", msg->name, bot->sent, bot->received);
+    blclient_send(c, reply);    // skipped if the queue is full
+  }
+}
+
+int main(int argc, char **argv) {
+  check_fail(argc < 3, 0, "usage: %s <server name> <bot name> [messages to send]\n", argv[0]);
+  long to_send = argc > 3 ? atol(argv[3]) : 10000;
+  bot_t bot = {};
+  snprintf(bot.name, MAXNAME, "%s", argv[2]);
+  blclient_t *c = malloc(sizeof(blclient_t));
+  check_fail(c == NULL, 1, "bl_bot: couldn't allocate a connection\n");
+  check_fail(blclient_join(c, argv[1], argv[2], 0) != 0, 1, "bl_bot: couldn't join %s\n", argv[1]);
+
+  long start = clock_usec();
+  while (!c->shutdown && bot.echoed < to_send) {
+    while (bot.sent < to_send) {
+      char text[MAXLINE];
+      snprintf(text, MAXLINE, "message %ld from %s", bot.sent, bot.name);
+      if (blclient_send(c, text) != 0)
+        break;                  // queue is full until the server reads some
+      bot.sent++;
+    }
+    check_fail(blclient_flush(c) == -1, 1, "bl_bot: couldn't send\n");
+    struct pollfd pfds[2];
+    int n = blclient_pollfds(c, pfds);
+    if (poll(pfds, n, 1000) == -1 && errno != EINTR)
+      break;
+    check_fail(blclient_dispatch(c, bot_handle, &bot) == -1, 0, "bl_bot: garbled message from server\n");
+  }
+  long usec = clock_usec() - start;
+
+  printf("%s: sent %ld, %ld echoed back, %ld messages received, %ld missed in %.3f s\n",
+         bot.name, bot.sent, bot.echoed, bot.received, bot.missed, usec / 1e6);
+  printf("%s: %.0f messages/s\n", bot.name, bot.echoed / (usec / 1e6));
+  if (c->shutdown)
+    blclient_close(c);
+  else
+    blclient_depart(c);
+  free(c);
+  return 0;
+}
@@ -0,0 +1,274 @@
+#include "blather.h"
+
+// bl_replay: feed the traffic of a capture trace, recorded by running
+// bl_server with BL_CAPTURE=<trace file>, into a running server and
+// check that its log ends up holding the same chat messages.
+//
+// usage: bl_replay <server name> <trace file> [paced|fast]
+//
+// paced, the default, keeps the trace's original timing; fast sends
+// everything as quickly as the server takes it, which makes a
+// throughput benchmark of real traffic shapes. Each client of the
+// trace gets its own connection through libblather_client, which also
+// answers the server's pings. Ticks are only counted since the server
+// keeps its own time.
+//
+// Verification needs the server to keep a log (BL_ADVANCED). Messages
+// of different clients may interleave differently than in the
+// original run, so each sender's messages are compared in order.
+
+typedef struct {
+  char *name;                   // sender of the message
+  char *body;                   // text of the message
+  long order;                   // position among all the messages compared
+} sent_t;
+
+static blclient_t **conns;      // connection of each join number, NULL if not connected
+static char (*conn_names)[MAXNAME]; // name each join number joined as
+static int *active;             // join numbers of open connections
+static char *leaving;           // flags: connection of each join number is leaving
+static int n_active;
+static long received;           // messages received by all connections
+
+// Callback for each message a connection receives.
+static void replay_handle(blclient_t *c, mesg_t *msg, void *arg) {
+  received++;
+}
+
+// Close connection conn, which has left the server.
+static void replay_close(int conn) {
+  blclient_close(conns[conn]);
+  free(conns[conn]);
+  conns[conn] = NULL;
+  for (int i = 0; i < n_active; i++) {
+    if (active[i] == conn) {
+      active[i] = active[--n_active];
+      break;
+    }
+  }
+}
+
+// Wait up to timeout_ms for any connection to have input or room to
+// write, then flush and drain every connection that does. Connections
+// which are leaving are closed once the server has read their
+// departure; the server keeps writing to them until then.
+static void replay_pump(int timeout_ms) {
+  struct pollfd *pfds = malloc(sizeof(struct pollfd) * 2 * (n_active + 1));
+  check_fail(pfds == NULL, 1, "bl_replay: couldn't allocate\n");
+  int n = 0;
+  for (int i = 0; i < n_active; i++)
+    n += blclient_pollfds(conns[active[i]], pfds + n);
+  poll(pfds, n, timeout_ms);
+  for (int i = n_active - 1; i >= 0; i--) {
+    int conn = active[i];
+    blclient_t *c = conns[conn];
+    check_fail(blclient_flush(c) == -1, 1, "bl_replay: couldn't write to the server\n");
+    check_fail(blclient_dispatch(c, replay_handle, NULL) == -1, 0, "bl_replay: garbled message from server\n");
+    if (leaving[conn] && blclient_pending(c) == 0)
+      replay_close(conn);
+  }
+  free(pfds);
+}
+
+// Have connection conn leave the server.
+static void replay_leave(int conn) {
+  while (blclient_leave(conns[conn]) != 0)
+    replay_pump(10);            // server is behind; let it catch up
+  leaving[conn] = 1;
+}
+
+// Order messages by sender, then by when they were sent.
+static int sent_cmp(const void *a, const void *b) {
+  const sent_t *x = a, *y = b;
+  int cmp = strcmp(x->name, y->name);
+  if (cmp != 0)
+    return cmp;
+  return x->order < y->order ? -1 : x->order > y->order;
+}
+
+// Add a copy of a message to list.
+static void sent_add(sent_t *list, long *n, char *name, char *body) {
+  list[*n].name = strdup(name);
+  list[*n].body = strdup(body);
+  list[*n].order = *n;
+  (*n)++;
+}
+
+// Read the chat messages the server logged from offset off into a
+// newly allocated list, waiting up to a few seconds for the last of
+// expect of them to be written. Returns the number read.
+static long replay_read_log(char *logname, long off, long expect, sent_t **list) {
+  long n = 0, seen = -1;
+  long start = clock_usec();
+  nametab_t *tab = malloc(sizeof(nametab_t));
+  check_fail(tab == NULL, 1, "bl_replay: couldn't allocate\n");
+  *list = NULL;
+  while (1) {
+    for (long i = 0; i < n; i++) {
+      free((*list)[i].name);
+      free((*list)[i].body);
+    }
+    free(*list);
+    *list = malloc(sizeof(sent_t) * (expect + 1));
+    check_fail(*list == NULL, 1, "bl_replay: couldn't allocate\n");
+    nametab_init(tab);
+    n = 0;
+    int fd = open(logname, O_RDONLY);
+    check_fail(fd == -1, 1, "bl_replay: couldn't open %s\n", logname);
+    logscan_t scan;
+    logscan_open(&scan, fd, off);
+    mesg_t msg;
+    while (n <= expect && logscan_next(&scan, &msg) == 1) {
+      nametab_resolve(tab, &msg);
+      if (msg.kind == BL_MESG)
+        sent_add(*list, &n, msg.name, msg.body);
+    }
+    logscan_close(&scan);
+    close(fd);
+    if (n >= expect || (n == seen && clock_usec() - start > 5000000))
+      break;
+    if (n != seen)
+      start = clock_usec(); // still growing; give it longer
+    seen = n;
+    pause_for(100000000, 0);
+  }
+  free(tab);
+  return n;
+}
+
+int main(int argc, char **argv) {
+  check_fail(argc < 3, 0, "usage: %s <server name> <trace file> [paced|fast]\n", argv[0]);
+  int fast = argc > 3 && strcmp(argv[3], "fast") == 0;
+
+  // the whole trace is read up front so reading it does not slow the replay
+  int fd = open(argv[2], O_RDONLY);
+  check_fail(fd == -1, 1, "bl_replay: couldn't open %s\n", argv[2]);
+  struct stat st;
+  check_fail(fstat(fd, &st) == -1, 1, "bl_replay: couldn't stat %s\n", argv[2]);
+  char *trace = malloc(st.st_size);
+  check_fail(trace == NULL, 1, "bl_replay: couldn't allocate the trace\n");
+  long len = 0;
+  while (len < st.st_size) {
+    int bytes = read(fd, trace + len, st.st_size - len);
+    check_fail(bytes <= 0, 1, "bl_replay: couldn't read %s\n", argv[2]);
+    len += bytes;
+  }
+  close(fd);
+  tracehdr_t hdr;
+  check_fail(len < sizeof(hdr), 0, "bl_replay: %s is not a capture trace\n", argv[2]);
+  memcpy(&hdr, trace, sizeof(hdr));
+  check_fail(hdr.magic != TRACE_MAGIC, 0, "bl_replay: %s is not a capture trace\n", argv[2]);
+
+  // first pass: size the tables and note what the log should end up with
+  trace_t rec;
+  mesg_t msg;
+  long pos = sizeof(hdr), n_events = 0, n_mesgs = 0, last_usec = 0;
+  int n_conns = 0;
+  while (pos < len) {
+    int ret = trace_decode(trace + pos, len - pos, &rec, &msg);
+    if (ret <= 0)
+      break;                    // a capture cut short by a crash ends in a partial event
+    pos += ret;
+    n_events++;
+    last_usec = rec.usec;
+    if (rec.event == TRACE_JOIN && rec.conn >= n_conns)
+      n_conns = rec.conn + 1;
+    if (rec.event == TRACE_MESG && msg.kind == BL_MESG)
+      n_mesgs++;
+  }
+  len = pos;
+  conns = calloc(n_conns + 1, sizeof(blclient_t *));
+  conn_names = calloc(n_conns + 1, MAXNAME);
+  active = calloc(n_conns + 1, sizeof(int));
+  leaving = calloc(n_conns + 1, 1);
+  sent_t *expect = malloc(sizeof(sent_t) * (n_mesgs + 1));
+  check_fail(!conns || !conn_names || !active || !leaving || !expect, 1, "bl_replay: couldn't allocate\n");
+
+  char logname[MAXPATH+4];
+  snprintf(logname, MAXPATH+4, "%s.log", argv[1]);
+  long log_off = stat(logname, &st) == 0 ? st.st_size : -1;
+
+  // second pass: replay
+  long n_joins = 0, n_sent = 0, n_ticks = 0, n_expect = 0, max_lag = 0;
+  long start = clock_usec();
+  pos = sizeof(hdr);
+  while (pos < len) {
+    pos += trace_decode(trace + pos, len - pos, &rec, &msg);
+    if (!fast) {
+      long due = start + rec.usec;
+      long now;
+      while ((now = clock_usec()) < due)
+        replay_pump((due - now) / 1000);
+      if (now - due > max_lag)
+        max_lag = now - due;
+    }
+    if (rec.event == TRACE_TICK) {
+      n_ticks++;
+    } else if (rec.event == TRACE_JOIN) {
+      if (conns[rec.conn] != NULL)
+        continue;
+      blclient_t *c = malloc(sizeof(blclient_t));
+      check_fail(c == NULL, 1, "bl_replay: couldn't allocate a connection\n");
+      check_fail(blclient_join(c, argv[1], msg.name, msg.seq) != 0, 1, "bl_replay: couldn't join %s\n", argv[1]);
+      conns[rec.conn] = c;
+      snprintf(conn_names[rec.conn], MAXNAME, "%s", msg.name);
+      active[n_active++] = rec.conn;
+      n_joins++;
+    } else if (rec.conn < 0 || rec.conn >= n_conns || conns[rec.conn] == NULL) {
+      continue;                 // client joined before the capture started
+    } else if (msg.kind == BL_MESG) {
+      while (blclient_send(conns[rec.conn], msg.body) != 0)
+        replay_pump(10);        // server is behind; let it catch up
+      sent_add(expect, &n_expect, conn_names[rec.conn], msg.body);
+      n_sent++;
+      if (fast && n_sent % 64 == 0)
+        replay_pump(0);
+    } else if (msg.kind == BL_DEPARTED && !leaving[rec.conn]) {
+      replay_leave(rec.conn);
+    }
+    // pings and name lookups are answered by each connection itself
+  }
+  for (int i = 0; i < n_active; i++) {
+    if (!leaving[active[i]])
+      replay_leave(active[i]);
+  }
+  long waited = clock_usec(), was_active = n_active;
+  while (n_active > 0 && clock_usec() - waited < 5000000) {
+    replay_pump(10);
+    if (n_active != was_active) {
+      was_active = n_active;
+      waited = clock_usec();
+    }
+  }
+  check_fail(n_active > 0, 0, "bl_replay: server stopped reading from %d clients\n", n_active);
+  long usec = clock_usec() - start;
+
+  printf("replayed %ld events (%ld joins, %ld messages, %ld ticks) spanning %.3f s in %.3f s, %s\n",
+         n_events, n_joins, n_sent, n_ticks, last_usec / 1e6, usec / 1e6, fast ? "fast" : "paced");
+  printf("throughput: %.0f messages/s, %ld deliveries received", n_sent / (usec / 1e6), received);
+  if (!fast)
+    printf(", fell behind the trace by at most %.3f ms", max_lag / 1e3);
+  printf("\n");
+
+  if (log_off == -1) {
+    printf("no log %s to verify; run the server with BL_ADVANCED\n", logname);
+    return 0;
+  }
+  sent_t *logged;
+  long n_logged = replay_read_log(logname, log_off, n_expect, &logged);
+  qsort(expect, n_expect, sizeof(sent_t), sent_cmp);
+  qsort(logged, n_logged, sizeof(sent_t), sent_cmp);
+  long bad = 0;                 //messages logged other than as sent, among those paired up
+  for (long i = 0; i < n_expect && i < n_logged; i++) {
+    if (strcmp(expect[i].name, logged[i].name) != 0 || strcmp(expect[i].body, logged[i].body) != 0) {
+      if (bad == 0)
+        printf("first mismatch: expected [%s] : %s, logged [%s] : %s\n",
+               expect[i].name, expect[i].body, logged[i].name, logged[i].body);
+      bad++;
+    }
+  }
+  int ok = bad == 0 && n_expect == n_logged;
+  printf("verify: %ld messages sent, %ld logged, %ld mismatched: %s\n",
+         n_expect, n_logged, bad, ok ? "OK" : "FAIL");
+  return ok ? 0 : 1;
+}
@@ -2,15 +2,22 @@
 
 volatile int sigalarm = 0;
 volatile int sigterm = 0;
+volatile int sighup = 0;
+volatile int sigusr1 = 0;
 static void handle_signals(int signum) {
   //server has been signalled
   if (signum == SIGTERM || signum == SIGINT)
     sigterm = 1; //time to quit gracefully
   else if (signum == SIGALRM)
     sigalarm = 1; //time to ping clients
+  else if (signum == SIGHUP)
+    sighup = 1; //time to hand off to a freshly exec'd server
+  else if (signum == SIGUSR1)
+    sigusr1 = 1; //time to dump phase spans (make SPANS=1)
 }
 
 void *spawn_server_write_who_as_thread(void *server){
+  SPAN_THREAD("who writer");
   server_write_who((server_t *)server);
   return NULL;
 }
@@ -28,37 +35,91 @@ int main(int argc, char **argv) {
   sigaction(SIGINT, &sa, NULL); //ctrl+c for graceful shutdown
   sigaction(SIGTERM, &sa, NULL); //SIGKILL and SIGSTOP will still ungracefully halt execution
   sigaction(SIGALRM, &sa, NULL);
+  sigaction(SIGHUP, &sa, NULL); //kill -HUP after installing a new bl_server to upgrade in place
+  sigaction(SIGUSR1, &sa, NULL); //kill -USR1 to write BL_SPANS without stopping
+  SPAN_OPEN();
+
+  //the binary to exec on SIGHUP, resolved now in case the working directory changes
+  char exe[PATH_MAX];
+  if (strchr(argv[0], '/') == NULL || realpath(argv[0], exe) == NULL)
+    snprintf(exe, PATH_MAX, "/proc/self/exe");
 
   server_t server;
-  server_start(&server, argv[1], S_IRUSR | S_IWUSR);
+  char *handoff = getenv("BL_HANDOFF");
+  if (handoff != NULL) {
+    int fd = atoi(handoff);
+    unsetenv("BL_HANDOFF"); //not for any process started later
+    server_resume(&server, argv[1], fd);
+  } else {
+    server_start(&server, argv[1], S_IRUSR | S_IWUSR);
+  }
 
   if (DO_ADVANCED) {
     alarm(1); //alarm for pinging 
   }
 
+  pthread_t write_who;
+  int who_started = 0;
+
   //loop forever unless signalled to stop
   while(!sigterm) {
     dbg_printf("At the top of main loop\n");
+    if (sigusr1) {
+      sigusr1 = 0;
+      SPAN_DUMP();
+    }
+    if (sighup) {
+      sighup = 0;
+      if (who_started)
+        pthread_join(write_who, NULL); //must not hold the log semaphore across the exec
+      who_started = 0;
+      alarm(0);                        //alarms survive exec but the handler does not
+      SPAN_DUMP();                     //the new process starts its spans afresh
+      server_handoff(&server, exe, argv);
+      if (DO_ADVANCED)                 //only returns if the handoff was abandoned
+        alarm(1);
+    }
     if (sigalarm) {
       sigalarm = 0;
       dbg_printf("Alarm went off\n");
+      SPAN_BEGIN(alarm_span);
       server_tick(&server);
       server_ping_clients(&server);
       server_remove_disconnected(&server, 5);
-      pthread_t write_who;
+      if (DO_ADVANCED && server.time_sec % CKPT_SECS == 0)
+        server_checkpoint(&server); //bounds the log a restart has to verify
+      if (who_started)
+        pthread_join(write_who, NULL); //long finished; keeps at most one writer of the who_t
       pthread_create(&write_who, NULL, 
         spawn_server_write_who_as_thread, (void *)&server); //server_write_who in its own thread 
+      who_started = 1;
       alarm(1);                                             //because of the blocking semaphore
+      SPAN_END(alarm_span, "alarm", server.n_clients);
     }
+    SPAN_BEGIN(sources_span);
     server_check_sources(&server);
+    SPAN_END(sources_span, "check_sources", server.n_clients);
     dbg_printf("Finished checking sources\n");
-    if (server_join_ready(&server))
+    if (server_join_ready(&server)) {
+      SPAN_BEGIN(join_span);
       server_handle_join(&server);
+      SPAN_END(join_span, "handle_join", server.n_clients);
+    }
+    if (server.fed_ready) {
+      SPAN_BEGIN(fed_span);
+      fed_handle(&server); //relayed broadcasts and servers joining the federation
+      SPAN_END(fed_span, "fed_handle", -1);
+    }
     dbg_printf("Checking %d clients\n", server.n_clients);
     for (int i = 0; i < server.n_clients;i++)
-      if(server_client_ready(&server, i))
+      if(server_client_ready(&server, i)) {
+        SPAN_BEGIN(client_span);
         server_handle_client(&server, i);
+        SPAN_END(client_span, "handle_client", i);
+      }
+    server_flush(&server, 0); //BL_BATCH: one write per client for this pass's broadcasts
   }
   server_shutdown(&server);
+  SPAN_DUMP();
   return 0;
 }
\ No newline at end of file
@@ -1,23 +1,419 @@
+#define _GNU_SOURCE             // strptime() for time filters
 #include "blather.h"
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <getopt.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// bl_showlog: print the chat messages of a server's log.
+//
+// usage: bl_showlog [options] <log file>
+//
+//   --from NAME      only messages sent by, or events about, NAME
+//   --kind KIND      only messages of KIND: mesg, joined, departed,
+//                    disconnected or shutdown; may be repeated
+//   --since TIME     only messages sent at or after TIME, given as
+//   --until TIME     "YYYY-MM-DD HH:MM[:SS]" local time or seconds
+//                    since the epoch; --until excludes TIME itself
+//   --grep TEXT      only chat messages containing TEXT
+//   -n, --tail N     only the last N of the messages selected
+//   -c, --count      a summary of the messages selected in place of them
+//   -f, --follow     keep printing messages as the server logs them
+//
+// With no options the log's who_t is printed ahead of every message
+// as before. The log is mapped into memory and records are decoded in
+// place, with output gathered into SHOWLOG_BUF bytes per write, so a
+// large log is shown at the speed it can be read. --tail without
+// filters starts from the log's index, found in the checkpoint next to
+// a "name.log", rather than reading all of the log twice. --follow
+// waits on inotify for the server to append to the log; records of a
+// BL_LOGZ log show up as each block is sealed.
+
+// filter_t: which messages are shown, from the command line
+typedef struct {
+  char *from;                   // name of the sender, NULL for any
+  int kinds;                    // bit kind/10 set for each kind shown, 0 for all
+  long since;                   // earliest time shown in usec since the epoch, 0 for any
+  long until;                   // time from which nothing is shown, 0 for none
+  char *grep;                   // text a chat message must contain, NULL for any
+  int grep_len;
+  long tail;                    // number of messages shown from the end, 0 for all
+  int count;                    // flag: summarize rather than print
+  int follow;                   // flag: wait for more records at the end of the log
+} filter_t;
+
+// pass_t: a reading of the log from some offset
+typedef struct {
+  logscan_t scan;
+  nametab_t names;              // names announced so far in the reading
+} pass_t;
+
+// stats_t: summary of the messages selected for --count
+typedef struct {
+  long messages;                // messages selected
+  long kind[16];                // messages selected of each kind, indexed by kind/10
+  long body_bytes;              // bytes of chat text selected
+  long first;                   // time of the first message selected
+  long last;                    // time of the last message selected
+  char **senders;               // hash set of the names of the senders selected
+  int n_senders;
+  int max_senders;              // size of senders, a power of 2
+} stats_t;
+
+static struct {
+  char *name;
+  int kind;
+} kind_names[] = {
+  {"mesg", BL_MESG},
+  {"joined", BL_JOINED},
+  {"departed", BL_DEPARTED},
+  {"disconnected", BL_DISCONNECTED},
+  {"shutdown", BL_SHUTDOWN},
+};
+#define N_KINDS (sizeof(kind_names) / sizeof(kind_names[0]))
+
+static filter_t filter;
+static char out[SHOWLOG_BUF];   // output waiting to be written
+static int out_len;
+
+// Write out all buffered output.
+static void out_flush() {
+  for (int off = 0; off < out_len; ) {
+    int bytes = write(STDOUT_FILENO, out + off, out_len - off);
+    check_fail(bytes <= 0, 1, "bl_showlog: couldn't write output\n");
+    off += bytes;
+  }
+  out_len = 0;
+}
+
+// Append formatted text to the output.
+static void out_printf(char *fmt, ...) {
+  if (SHOWLOG_BUF - out_len < MAXLINE + MAXNAME + 8)
+    out_flush();
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(out + out_len, SHOWLOG_BUF - out_len, fmt, args);
+  va_end(args);
+  out_len += len < SHOWLOG_BUF - out_len ? len : SHOWLOG_BUF - out_len - 1;
+}
+
+// Append a message to the output as bl_client shows it.
+static void out_mesg(mesg_t *msg) {
+  if (SHOWLOG_BUF - out_len < MAXLINE + MAXNAME + 8)
+    out_flush();
+  if (client_format_mesg(msg, out + out_len) != NULL)
+    out_len += strlen(out + out_len);
+}
+
+// Returns 1 if the n bytes at text contain the m bytes of word. With
+// SSE2, 16 candidate positions are tested at a time by comparing the
+// first and last bytes of word against the text, and only positions
+// where both match are compared in full.
+static int text_contains(const char *text, int n, const char *word, int m) {
+  if (m == 0)
+    return 1;
+  int i = 0;
+#ifdef __SSE2__
+  __m128i first = _mm_set1_epi8(word[0]);
+  __m128i last = _mm_set1_epi8(word[m-1]);
+  for (; i + m - 1 + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *) (text + i));
+    __m128i b = _mm_loadu_si128((const __m128i *) (text + i + m - 1));
+    unsigned int hits = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (hits != 0) {
+      int at = i + __builtin_ctz(hits);
+      if (memcmp(text + at, word, m) == 0)
+        return 1;
+      hits &= hits - 1;
+    }
+  }
+#endif
+  for (; i + m <= n; i++) {
+    if (text[i] == word[0] && memcmp(text + i, word, m) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+// Returns 1 if msg is a message which the filter lets through.
+// Snapshots and name maps are never shown.
+static int show_match(mesg_t *msg) {
+  int shown = 0;
+  for (int k = 0; k < N_KINDS; k++)
+    shown |= msg->kind == kind_names[k].kind;
+  if (!shown)
+    return 0;
+  if (filter.kinds != 0 && !(filter.kinds & 1 << msg->kind / 10))
+    return 0;
+  if (filter.from != NULL && strcmp(msg->name, filter.from) != 0)
+    return 0;
+  if (filter.since != 0 && msg->tstamp < filter.since)
+    return 0;
+  if (filter.until != 0 && msg->tstamp >= filter.until)
+    return 0;
+  if (filter.grep != NULL && (msg->kind != BL_MESG ||
+                              !text_contains(msg->body, strlen(msg->body), filter.grep, filter.grep_len)))
+    return 0;
+  return 1;
+}
+
+// Start reading the log of size bytes mapped at base from offset off.
+static void pass_open(pass_t *p, char *base, long size, long off) {
+  logscan_map(&p->scan, base, size, off);
+  nametab_init(&p->names);
+}
+
+// Read the next message the filter lets through into msg. Returns 1
+// if there was one, 0 at the end of the log and -1 if the rest of the
+// log is damaged or not yet completely written.
+static int pass_next(pass_t *p, mesg_t *msg) {
+  int ret;
+  while ((ret = logscan_next(&p->scan, msg)) == 1) {
+    nametab_resolve(&p->names, msg);
+    if (show_match(msg))
+      return 1;
+  }
+  return ret;
+}
+
+// Add name to the set of senders in stats.
+static void stats_sender(stats_t *stats, char *name) {
+  if (2 * (stats->n_senders + 1) > stats->max_senders) {
+    char **old = stats->senders;
+    int old_max = stats->max_senders;
+    stats->max_senders = old_max ? old_max * 2 : 256;
+    stats->senders = calloc(stats->max_senders, sizeof(char *));
+    check_fail(stats->senders == NULL, 1, "bl_showlog: couldn't allocate\n");
+    stats->n_senders = 0;
+    for (int i = 0; i < old_max; i++) {
+      if (old[i] != NULL)
+        stats_sender(stats, old[i]);
+      free(old[i]);
+    }
+    free(old);
+  }
+  unsigned int h = 2166136261u;
+  for (char *c = name; *c != '\0'; c++)
+    h = (h ^ (unsigned char) *c) * 16777619u;
+  int i = h & (stats->max_senders - 1);
+  while (stats->senders[i] != NULL) {
+    if (strcmp(stats->senders[i], name) == 0)
+      return;
+    i = (i + 1) & (stats->max_senders - 1);
+  }
+  stats->senders[i] = strdup(name);
+  check_fail(stats->senders[i] == NULL, 1, "bl_showlog: couldn't allocate\n");
+  stats->n_senders++;
+}
+
+// Count msg in the summary.
+static void stats_add(stats_t *stats, mesg_t *msg) {
+  if (stats->messages == 0)
+    stats->first = msg->tstamp;
+  stats->last = msg->tstamp;
+  stats->messages++;
+  stats->kind[msg->kind / 10]++;
+  if (msg->kind == BL_MESG) {
+    stats->body_bytes += strlen(msg->body);
+    stats_sender(stats, msg->name);
+  }
+}
+
+// Append the time usec microseconds after the epoch to the output.
+static void out_time(long usec) {
+  time_t secs = usec / 1000000;
+  char buf[64];
+  strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&secs));
+  out_printf("%s", buf);
+}
+
+// Append the summary to the output.
+static void stats_print(stats_t *stats, long log_bytes) {
+  out_printf("%ld messages, %ld bytes of chat from %d senders in %ld bytes of log\n",
+             stats->messages, stats->body_bytes, stats->n_senders, log_bytes);
+  if (stats->messages > 0) {
+    out_printf("from ");
+    out_time(stats->first);
+    out_printf(" to ");
+    out_time(stats->last);
+    out_printf("\n");
+  }
+  for (int k = 0; k < N_KINDS; k++)
+    out_printf("%s: %ld\n", kind_names[k].name, stats->kind[kind_names[k].kind / 10]);
+}
+
+// Parse a time given on the command line into usec since the epoch.
+static long parse_time(char *arg) {
+  char *formats[] = {"%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d"};
+  for (int i = 0; i < 3; i++) {
+    struct tm tm = { .tm_isdst = -1 };
+    char *end = strptime(arg, formats[i], &tm);
+    if (end != NULL && *end == '\0')
+      return mktime(&tm) * 1000000L;
+  }
+  char *end;
+  double secs = strtod(arg, &end);
+  check_fail(end == arg || *end != '\0', 0, "bl_showlog: can't read time '%s'\n", arg);
+  return secs * 1e6;
+}
+
+// Find where to start reading a log for --tail without filters: the
+// index entry of its checkpoint at or before the last tail
+// broadcasts, if there is a checkpoint which fits the log.
+static long tail_start(char *path, char *base, long size) {
+  int len = strlen(path);
+  if (len < 5 || len > MAXPATH || strcmp(path + len - 4, ".log") != 0)
+    return sizeof(who_t);
+  char server_name[MAXPATH];
+  snprintf(server_name, MAXPATH, "%.*s", len - 4, path);
+  ckpt_t ckpt;
+  logidx_t *index;
+  if (log_read_checkpoint(server_name, &ckpt, &index) != 0)
+    return sizeof(who_t);
+  long off = log_index_find(index, ckpt.n_index, ckpt.last_seq - filter.tail);
+  free(index);
+  int kind = 0;
+  if (off > sizeof(who_t) && off + sizeof(wire_t) <= size)
+    memcpy(&kind, base + off + offsetof(wire_t, kind), sizeof(int));
+  return kind == BL_SNAPSHOT || kind == BL_LOGBLOCK ? off : sizeof(who_t);
+}
+
+// Map the log open on fd, returning its start and setting *size.
+static char *map_log(int fd, long *size) {
+  struct stat st;
+  check_fail(fstat(fd, &st) == -1, 1, "bl_showlog: couldn't examine the log\n");
+  check_fail(st.st_size < sizeof(who_t), 0, "bl_showlog: the log is too short to be a log\n");
+  char *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  check_fail(base == MAP_FAILED, 1, "bl_showlog: couldn't map the log\n");
+  madvise(base, st.st_size, MADV_SEQUENTIAL);
+  *size = st.st_size;
+  return base;
+}
+
+// Show messages the server appends to the log from where p left off
+// until the log is removed or replaced.
+static void follow(char *path, int fd, pass_t *p, char *base, long size) {
+  int ifd = inotify_init();
+  check_fail(ifd == -1, 1, "bl_showlog: couldn't watch the log\n");
+  check_fail(inotify_add_watch(ifd, path, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF) == -1, 1,
+             "bl_showlog: couldn't watch %s\n", path);
+  while (1) {
+    out_flush();
+    char events[4096];
+    int bytes = read(ifd, events, sizeof(events));
+    if (bytes == -1 && errno == EINTR)
+      continue;
+    check_fail(bytes <= 0, 1, "bl_showlog: couldn't watch the log\n");
+    for (int off = 0; off < bytes; ) {
+      struct inotify_event *ev = (struct inotify_event *) (events + off);
+      if (ev->mask & IN_MOVE_SELF)
+        return;
+      off += sizeof(struct inotify_event) + ev->len;
+    }
+    struct stat st;
+    check_fail(fstat(fd, &st) == -1, 1, "bl_showlog: couldn't examine the log\n");
+    if (st.st_nlink == 0)
+      return;                   // removed; the open log would never grow again
+    check_fail(st.st_size < p->scan.off, 0, "bl_showlog: the log was truncated\n");
+    if (st.st_size == size)
+      continue;                 // only the who_t was rewritten
+    munmap(base, size);
+    base = map_log(fd, &size);
+    logscan_remap(&p->scan, base, size);
+    mesg_t msg;
+    while (pass_next(p, &msg) == 1)
+      out_mesg(&msg);           // a partial record is left for the next append
+  }
+}
 
 int main(int argc, char **argv) {
-  check_fail(argc < 2, 0, "usage: %s <filename>\n", argv[0]);
+  struct option options[] = {
+    {"from", required_argument, NULL, 'F'},
+    {"kind", required_argument, NULL, 'k'},
+    {"since", required_argument, NULL, 's'},
+    {"until", required_argument, NULL, 'u'},
+    {"grep", required_argument, NULL, 'g'},
+    {"tail", required_argument, NULL, 'n'},
+    {"count", no_argument, NULL, 'c'},
+    {"follow", no_argument, NULL, 'f'},
+    {NULL, 0, NULL, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "n:cf", options, NULL)) != -1) {
+    switch (opt) {
+      case 'F': filter.from = optarg; break;
+      case 's': filter.since = parse_time(optarg); break;
+      case 'u': filter.until = parse_time(optarg); break;
+      case 'g': filter.grep = optarg; filter.grep_len = strlen(optarg); break;
+      case 'n': filter.tail = atol(optarg); break;
+      case 'c': filter.count = 1; break;
+      case 'f': filter.follow = 1; break;
+      case 'k': {
+        int k = 0;
+        while (k < N_KINDS && strcmp(kind_names[k].name, optarg) != 0)
+          k++;
+        check_fail(k == N_KINDS, 0, "bl_showlog: unknown kind '%s'\n", optarg);
+        filter.kinds |= 1 << kind_names[k].kind / 10;
+        break;
+      }
+      default:
+        check_fail(1, 0, "usage: %s [--from NAME] [--kind KIND] [--since TIME] [--until TIME] [--grep TEXT]\n"
+                   "       [--tail N] [--count] [--follow] <filename>\n", argv[0]);
+    }
+  }
+  check_fail(optind != argc - 1, 0, "usage: %s [options] <filename>\n", argv[0]);
+  char *path = argv[optind];
+  int selecting = filter.from || filter.kinds || filter.since || filter.until || filter.grep;
 
-  int rdfd = open(argv[1], O_RDONLY);
+  int rdfd = open(path, O_RDONLY);
   check_fail(rdfd == -1, 1, "couldn't open file");
-  who_t who;
-  int bytes = read(rdfd, &who, sizeof(who_t));
-  check_fail(bytes != sizeof(who_t), 1, "a read error occurred. check that the file is legit\n");
-  printf("%d CLIENTS\n", who.n_clients);
-  for (int i = 0; i < who.n_clients; i++) {
-    printf("%d: %s\n", i, who.names[i]);
-  }
-  printf("MESSAGES\n");
+  long size;
+  char *base = map_log(rdfd, &size);
+  if (optind == 1) {            // no options, show the log as it always was
+    who_t who;
+    memcpy(&who, base, sizeof(who_t));
+    out_printf("%d CLIENTS\n", who.n_clients);
+    for (int i = 0; i < who.n_clients && i < MAXCLIENTS; i++) {
+      out_printf("%d: %s\n", i, who.names[i]);
+    }
+    out_printf("MESSAGES\n");
+  }
+
+  long start = sizeof(who_t);
+  if (filter.tail > 0 && !selecting)
+    start = tail_start(path, base, size);
+  pass_t *pass = malloc(sizeof(pass_t));
+  check_fail(pass == NULL, 1, "bl_showlog: couldn't allocate\n");
   mesg_t msg;
-  char buf[MAXLINE+MAXNAME+8];
-  while((bytes = read(rdfd, &msg, sizeof(mesg_t)))) {
-    check_fail(bytes != sizeof(mesg_t), 1, "an unexpected read error occurred\n");
-    printf("%s", client_format_mesg(&msg, buf));
+  long skip = 0;
+  if (filter.tail > 0) {        // count what is selected first so only the last tail are shown
+    pass_open(pass, base, size, start);
+    while (pass_next(pass, &msg) == 1)
+      skip++;
+    logscan_close(&pass->scan);
+    skip -= filter.tail;
+  }
+  stats_t stats = {0};
+  pass_open(pass, base, size, start);
+  int ret;
+  while ((ret = pass_next(pass, &msg)) == 1) {
+    if (skip > 0)
+      skip--;
+    else if (filter.count)
+      stats_add(&stats, &msg);
+    else
+      out_mesg(&msg);
   }
+  if (filter.count)
+    stats_print(&stats, size);
+  else if (filter.follow)
+    follow(path, rdfd, pass, base, size);
+  out_flush();
+  check_fail(ret != 0 && !filter.follow, 0, "log is damaged at offset %ld\n", pass->scan.off);
+  logscan_close(&pass->scan);
+  free(pass);
   close(rdfd);
-}
\ No newline at end of file
+  return 0;
+}
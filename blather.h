@@ -13,6 +13,7 @@
 #include <poll.h>
 #include <limits.h>             // added for NAME_MAX
 #include <errno.h>              // ADDED for editor's intellisense resolution
+#include <time.h>
 
 #define DEBUG 1                 // turn of/off debug printing
 #define PROMPT ">> "            // prompt for client UI
@@ -21,6 +22,36 @@
 #define MAXNAME 256             // max length of user name for clients
 #define MAXPATH 1024            // max length filename paths
 #define MAXCLIENTS 256          // max number of clients accepted
+#define WINDOW 1024             // number of recent broadcasts kept in memory for catching up clients
+#define CATCHUP_BUF 65536       // bytes of missed messages sent to a rejoining client per write
+#define INDEX_BYTES (1<<20)     // ADVANCED: log bytes between name snapshots/index entries
+#define SCAN_BUF (1<<20)        // bytes read at a time when scanning the log
+#define CKPT_SECS 10            // ADVANCED: seconds between checkpoints of the log
+#define CKPT_MAGIC 0x424c4b31   // ADVANCED: identifies a checkpoint file, "BLK1"
+#define JOINQ_SLOTS 1024        // join requests the shared memory join queue holds
+#define JOINQ_PREFIX 64         // max length of the FIFO name prefix in a join request
+#define JOINQ_MAGIC 0x424c4a51  // marks an initialized join queue, "BLJQ"
+#define URING_ENTRIES 1024      // size of the submission queue of the io_uring backend
+#define URING_RBUF 8192         // bytes buffered per client by the io_uring backend
+#define URING_LOGBUF (1<<18)    // bytes of log records batched by the io_uring backend
+#define SIMPIO_CHUNK 65536      // bytes of piped input read at a time in bulk mode
+#define SIMPIO_BATCH 64         // max lines handed over at once in bulk mode
+#define BLCLIENT_OUTBUF (1<<17) // bytes of messages a headless client queues for the server
+#define TRACE_BUF (1<<16)       // bytes of capture trace the server buffers before writing
+#define TRACE_MAGIC 0x424c5452  // identifies a capture trace file, "BLTR"
+#define HANDOFF_MAGIC 0x424c4832 // identifies server state handed to a new process, "BLH2"
+#define MAXPEERS 16             // followers a federation leader accepts
+#define FED_INBUF 65536         // bytes read from a federation link at a time
+#define FED_OUTBUF 65536        // initial bytes of records batched per federation link
+#define LOGZ_BLOCK 65536        // ADVANCED: bytes of records gathered before BL_LOGZ compresses a block
+#define SHOWLOG_BUF (1<<20)     // bytes of output bl_showlog gathers per write
+#define SEARCH_TOKEN 32         // ADVANCED: longest word %search indexes, with its terminator
+#define SEARCH_HITS 20          // ADVANCED: most messages a %search returns
+#define BATCH_BUF 65536         // bytes of broadcasts gathered under BL_BATCH for one write per client
+#define POOL_BATCH 64           // message buffers moved at once between per-thread and shared free lists
+#define SPAN_RING (1<<16)       // phase spans each thread keeps for BL_SPANS, the oldest overwritten first
+
+#define NOID -1                 // name_id of messages with no sender/subject
 
 #define EOT 4                   // ascii code of typical EOF character
 #define DEL 127                 // ascii code of typical backspace key
@@ -41,27 +72,43 @@ typedef struct {
   char to_server_fname[MAXPATH];  // name of file (FIFO) to read from receive from client
   int data_ready;                 // flag indicating a mesg_t can be read from to_server_fd
   int last_contact_time;          // ADVANCED: server time at which last contact was made with client
+  int id;                         // session id announced in place of the name in messages
+  int conn;                       // join number of the client, names it in capture traces
+  char *held;                     // bytes io_uring read from the client before a handoff to a poll() server, NULL if none
+  int held_len;                   // number of bytes in held, handled ahead of to_server_fd
 } client_t;
 
-// server_t: data pertaining to server operations
-typedef struct {
-  char server_name[MAXPATH];    // name of server which dictates file names for joining and logging
-  int join_fd;                  // file descriptor of join file/FIFO
-  int join_ready;               // flag indicating if a join is available
-  int n_clients;                // number of clients communicating with server
-  client_t client[MAXCLIENTS];  // array of clients populated up to n_clients
-  int time_sec;                 // ADVANCED: time in seconds since server started
-  int log_fd;                   // ADVANCED: file descriptor for log
-  sem_t *log_sem;               // ADVANCED: posix semaphore to control who_t section of log file
-} server_t;
-
 // join_t: structure for requests to join the chat room
 typedef struct {
   char name[MAXNAME];            // name of the client joining the server *changed to use MAXNAME instead of MAXPATH
   char to_client_fname[MAXPATH]; // name of file server writes to to send to client
   char to_server_fname[MAXPATH]; // name of file client writes to to send to server
+  long last_seq;                 // last sequence number a rejoining client saw, 0 for a fresh join
 } join_t;
 
+// joinrec_t: compact join request published in the server's shared
+// memory join queue in place of writing a join_t to its FIFO
+typedef struct {
+  char name[MAXNAME];              // name of the client joining the server
+  char fifo_prefix[JOINQ_PREFIX];  // client FIFOs are "<prefix>.client.fifo" and "<prefix>.server.fifo"
+  long last_seq;                   // as in join_t
+} joinrec_t;
+
+// joinslot_t: slot of the join queue
+typedef struct {
+  long seq;                        // position the slot is free or published for, see joinq_funcs.c
+  joinrec_t rec;                   // the join request
+} joinslot_t;
+
+// joinq_t: multi-producer ring of join requests in shared memory
+// "/server_name.joinq"; the join FIFO is only a doorbell
+typedef struct {
+  int magic;                       // JOINQ_MAGIC once the server has set up the queue
+  long tail;                       // next position to be claimed by a joining client
+  long head;                       // next position to be taken by the server
+  joinslot_t slot[JOINQ_SLOTS];    // requests indexed by position % JOINQ_SLOTS
+} joinq_t;
+
 // mesg_kind_t: Kinds of messages between server/client
 typedef enum {
   BL_MESG         = 10,         // normal messasge from client with name/body
@@ -70,21 +117,327 @@ typedef enum {
   BL_SHUTDOWN     = 40,         // server to client : server is shutting down, no name/body
   BL_DISCONNECTED = 50,         // ADVANCED: client disconnected abnormally, name only
   BL_PING         = 60,         // ADVANCED: ping to ask or show liveness
+  BL_NAMEMAP      = 70,         // server to client: id -> name mapping; client to server: request a mapping
+  BL_SNAPSHOT     = 80,         // ADVANCED: log only, a BL_NAMEMAP per client follows; readers may start here
+  BL_PEERED       = 90,         // federation links only: leader accepted a follower, see fed_funcs.c
+  BL_LOGBLOCK     = 100,        // ADVANCED: log only, a compressed block of records, see logblock_t
+  BL_FOUND        = 110,        // ADVANCED: server to client: a logged message matching the client's %search, name and body
 } mesg_kind_t;
 
 // mesg_t: struct for messages between server/client
 typedef struct {
   mesg_kind_t kind;               // kind of message
-  char name[MAXNAME];             // name of sending client or subject of event
+  long seq;                       // server assigned sequence number of a broadcast, 0 if unsequenced
+  long tstamp;                    // server time of the broadcast in microseconds since the epoch
+  int name_id;                    // session id of sending client or subject of event, NOID if none
+  char name[MAXNAME];             // name of sending client or subject of event, resolved from name_id
   char body[MAXLINE];             // body text, possibly empty depending on kind
 } mesg_t;
 
+// wire_t: compact header which precedes the body of each message
+// sent through a FIFO or appended to the log. Only the session id of
+// the sender travels with a message; BL_JOINED and BL_NAMEMAP carry
+// the name itself as their body so receivers can fill a nametab_t;
+// BL_FOUND carries both, the name, a NUL and then the body.
+// The checksum lets log readers detect records torn by a crash.
+typedef struct {
+  long seq;                       // sequence number, 0 for pings and other unsequenced messages
+  long tstamp;                    // microseconds since the epoch at which the server sent it
+  int kind;                       // mesg_kind_t of the message
+  int name_id;                    // session id of sending client or subject of event
+  int body_len;                   // number of body bytes following the header
+  unsigned int crc;               // CRC-32 of the header, taken with crc 0, and body
+} wire_t;
+
+#define MAXWIRE (sizeof(wire_t)+MAXLINE) // largest encoded message
+
+// largest name dictionary of a BL_LOGZ block, a BL_SNAPSHOT and a
+// BL_NAMEMAP per session id, and largest block once expanded, the
+// dictionary and records gathered until they reached LOGZ_BLOCK bytes
+#define LOGZ_DICT (sizeof(wire_t) + MAXCLIENTS*(sizeof(wire_t)+MAXNAME))
+#define LOGZ_MAXRAW (LOGZ_DICT + LOGZ_BLOCK + MAXWIRE)
+
+#define LZ_BOUND(n) ((n) + (n)/255 + 16) // largest output of lz_compress() for n bytes
+
+// logblock_t: header of a BL_LOGBLOCK in a log written under BL_LOGZ,
+// followed by comp_len bytes of the block compressed by lz_compress().
+// Laid out like wire_t so that readers find kind and crc in the same
+// place as for a plain record. Expanded, the block is a BL_SNAPSHOT,
+// a BL_NAMEMAP for each session id used in the block other than by a
+// BL_JOINED, then the records themselves, so every block can be read
+// without the ones before it.
+typedef struct {
+  long first_seq;                 // sequence number of the first broadcast in the block
+  long last_seq;                  // sequence number of the last broadcast in the block
+  int kind;                       // BL_LOGBLOCK
+  int raw_len;                    // number of bytes of records once expanded
+  int comp_len;                   // number of compressed bytes following the header
+  unsigned int crc;               // CRC-32 of the header, taken with crc 0, and compressed bytes
+} logblock_t;
+
+// trace_kind_t: inbound events the server records under BL_CAPTURE
+typedef enum {
+  TRACE_JOIN = 1,               // a client joined; its message names it and seq holds its last_seq
+  TRACE_MESG = 2,               // a message was read from a client, recorded as the client sent it
+  TRACE_TICK = 3,               // the server's alarm went off (ADVANCED)
+} trace_kind_t;
+
+// tracehdr_t: start of a capture trace file
+typedef struct {
+  int magic;                    // TRACE_MAGIC
+  long start;                   // microseconds since the epoch at which capture started
+} tracehdr_t;
+
+// trace_t: header of an event in a capture trace, followed by the
+// event's message in wire format for TRACE_JOIN and TRACE_MESG
+typedef struct {
+  long usec;                    // microseconds since capture started
+  int event;                    // trace_kind_t of the event
+  int conn;                     // join number of the client involved, -1 for ticks
+} trace_t;
+
+#define MAXTRACE (sizeof(trace_t)+MAXWIRE) // largest encoded trace event
+
+// relay_t: header of a record on a federation link, followed by the
+// message in wire format. The member the message is about is named by
+// the server it is connected to and its session id there, since each
+// server announces members under session ids of its own.
+typedef struct {
+  int origin;                   // server number of the member's server, 0 for the leader
+  int origin_id;                // session id of the member on that server
+} relay_t;
+
+// nametab_t: table of session ids to names kept by message receivers
+typedef struct {
+  char names[MAXCLIENTS][MAXNAME]; // names indexed by session id, empty if unknown
+} nametab_t;
+
+// msgbuf_t: buffer from the message pool holding one encoded
+// message, shared by reference among everything that sends, keeps or
+// logs it and returned to the pool when the last reference is
+// dropped, see pool_funcs.c
+typedef struct msgbuf {
+  struct msgbuf *next;          // next buffer on a free list
+  int refs;                     // number of references held
+  int size_class;               // the pool's size class it belongs to
+  int cap;                      // bytes of data available
+  int len;                      // bytes of data in use
+  char data[];                  // the encoded message
+} msgbuf_t;
+
+// poolstats_t: counts kept by the message pool, for BL_STATS
+typedef struct {
+  long gets;                    // buffers handed out
+  long heap;                    // buffers allocated from the heap
+  long last_heap;               // value of gets when the heap was last used
+  long live;                    // buffers currently referenced
+  long peak;                    // most buffers referenced at once
+} poolstats_t;
+
+// span_t: a timed phase of the server's work recorded for BL_SPANS,
+// see span_funcs.c
+typedef struct {
+  const char *name;             // the phase, a string constant
+  long start;                   // CLOCK_MONOTONIC nanoseconds at which it began
+  long end;                     // and at which it ended
+  int arg;                      // client index or a count, -1 if none
+} span_t;
+
+// Phase spans are compiled in only by 'make SPANS=1' and recorded only
+// when BL_SPANS names the file to dump them to; otherwise these expand
+// to nothing. SPAN_BEGIN(t) starts a span in a new variable t which
+// SPAN_END(t, name, arg) ends in the same block.
+#ifdef BL_SPANS
+extern int span_on;
+#define SPAN_BEGIN(t) long t = span_on ? span_now() : 0
+#define SPAN_END(t, name, arg) do { if (span_on) span_record(name, t, arg); } while (0)
+#define SPAN_OPEN() span_open()
+#define SPAN_THREAD(name) do { if (span_on) span_thread(name); } while (0)
+#define SPAN_DUMP() do { if (span_on) span_dump(); } while (0)
+#else
+#define SPAN_BEGIN(t)
+#define SPAN_END(t, name, arg)
+#define SPAN_OPEN()
+#define SPAN_THREAD(name)
+#define SPAN_DUMP()
+#endif
+
+// window_t: recently broadcast message kept for clients catching up
+typedef struct {
+  char name[MAXNAME];           // name of the message's subject at the time of broadcast
+  msgbuf_t *buf;                // a reference to the message as it was sent to clients, NULL if none
+  long seq;                     // sequence number of the message in buf, 0 if none
+} window_t;
+
+// searchhit_t: a logged chat message found by search_query()
+typedef struct {
+  long seq;                     // sequence number of the message
+  long off;                     // log offset of its record or of the BL_LOGBLOCK holding it
+  char name[MAXNAME];           // sender of the message
+} searchhit_t;
+
+// logidx_t: entry of the sparse log index, the offset of a
+// BL_SNAPSHOT from which records can be read and resolved (ADVANCED)
+typedef struct {
+  long seq;                     // sequence number of the last broadcast logged before off
+  long off;                     // offset of the BL_SNAPSHOT record in the log
+} logidx_t;
+
+// ckpt_t: header of the checkpoint file "server_name.ckpt" which is
+// followed by n_index logidx_t entries (ADVANCED)
+typedef struct {
+  int magic;                    // CKPT_MAGIC
+  int n_index;                  // number of index entries following the header
+  long last_seq;                // sequence number of the last broadcast logged
+  long valid_off;               // log offset up to which records have been verified
+  long last_off;                // offset of the final verified record, 0 if none
+  unsigned int last_crc;        // checksum of the final verified record
+} ckpt_t;
+
+// logscan_t: buffered reader of log records
+typedef struct {
+  int fd;                       // log being read, -1 for a log mapped by logscan_map()
+  char *buf;                    // SCAN_BUF bytes of the log, or all of it when mapped
+  long pos;                     // position of the next record in buf
+  long len;                     // number of valid bytes in buf
+  long off;                     // log offset of buf[pos]
+  long rec_off;                 // log offset of the record last returned, or of its BL_LOGBLOCK
+  unsigned int rec_crc;         // checksum of the record last returned, or of its BL_LOGBLOCK
+  char *block;                  // LOGZ_MAXRAW bytes for the records of an expanded BL_LOGBLOCK
+  int block_pos;                // position of the next record in block
+  int block_len;                // number of valid bytes in block
+  long block_off;               // log offset of the BL_LOGBLOCK being read
+  unsigned int block_crc;       // checksum of the BL_LOGBLOCK being read
+} logscan_t;
+
+// logz_t: records gathered by a server logging under BL_LOGZ until
+// they are compressed into the next BL_LOGBLOCK (ADVANCED)
+typedef struct {
+  char *raw;                    // LOGZ_MAXRAW bytes: LOGZ_DICT for the dictionary, then the records
+  int len;                      // number of bytes of records following the dictionary's room
+  long first_seq;               // as in logblock_t
+  long last_seq;
+  char named[MAXCLIENTS];       // flags: session id already used in the block
+  char names[MAXCLIENTS][MAXNAME]; // dictionary: names of ids whose first use didn't name them
+  char *out;                    // room for the logblock_t and compressed block
+} logz_t;
+
+// uring_t: io_uring backend for server I/O, see uring_funcs.c
+typedef struct uring uring_t;
+
+// fed_t: links to the other servers of a federated room, see fed_funcs.c
+typedef struct fed fed_t;
+
+// search_t: full-text index of the chat history, see search_funcs.c
+typedef struct search search_t;
+
+// server_t: data pertaining to server operations
+typedef struct {
+  char server_name[MAXPATH];    // name of server which dictates file names for joining and logging
+  int join_fd;                  // file descriptor of join file/FIFO, rung as a doorbell for joinq
+  joinq_t *joinq;               // shared memory queue of join requests
+  int join_ready;               // flag indicating if a join is available
+  int join_waiting;             // flag: joins may be queued which came while the server was full
+  int n_clients;                // number of clients communicating with server
+  client_t client[MAXCLIENTS];  // array of clients populated up to n_clients
+  int time_sec;                 // ADVANCED: time in seconds since server started
+  int log_fd;                   // ADVANCED: file descriptor for log
+  sem_t *log_sem;               // ADVANCED: posix semaphore to control who_t section of log file
+  long seq;                     // sequence number of the most recent broadcast
+  long window_first;            // earliest sequence number held in window
+  window_t *window;             // the last WINDOW broadcasts indexed by seq % WINDOW
+  ckpt_t ckpt;                  // ADVANCED: state of the log as of the latest record
+  logidx_t *index;              // ADVANCED: sparse index of the log, ckpt.n_index entries
+  int max_index;                // ADVANCED: allocated length of index
+  uring_t *uring;               // io_uring backend selected by BL_IO=uring, NULL when using poll()
+  long n_polls;                 // number of poll() calls made, for BL_STATS
+  long n_handled;               // number of messages read from clients, for BL_STATS
+  int n_joins;                  // number of join requests handled
+  int capture_fd;               // trace file named by BL_CAPTURE, -1 when not capturing
+  char *capture_buf;            // TRACE_BUF bytes of events not yet written to capture_fd
+  int capture_len;              // number of bytes in capture_buf
+  long capture_start;           // microseconds since the epoch at which capture started
+  fed_t *fed;                   // federation selected by BL_FEDERATE, NULL when serving alone
+  int fed_ready;                // flag indicating a federation link has input or a follower is connecting
+  logz_t *logz;                 // ADVANCED: block being gathered under BL_LOGZ, NULL for plain records
+  long log_records;             // ADVANCED: number of records logged, for BL_STATS
+  long log_bytes;               // ADVANCED: bytes those records take as plain records
+  long log_stored;              // ADVANCED: bytes written to the log for them
+  long log_usec;                // ADVANCED: microseconds spent encoding, compressing and writing them
+  search_t *search;             // ADVANCED: index for %search selected by BL_SEARCH, NULL if none
+  char *batch;                  // broadcasts gathered under BL_BATCH for one write per client, NULL if not batching
+  int batch_len;                // number of bytes in batch
+  int batch_count;              // number of broadcasts in batch
+  long batch_window;            // microseconds a broadcast may wait in batch for others to join it
+  long batch_start;             // microseconds since the epoch at which the oldest broadcast in batch was gathered
+  long batch_gathered;          // sum of those times for every broadcast in batch
+  long n_batches;               // batches written, for BL_STATS
+  long n_batched;               // broadcasts written in them
+  long batch_wait;              // total microseconds broadcasts waited in batch
+} server_t;
+
+// handoff_t: server state passed to a newly exec'd server by
+// server_handoff(). Followed by n_clients client_t, n_window window
+// entries for seq window_first onwards, each a name of MAXNAME bytes,
+// an int length and the encoded message, or a length of 0 for a
+// sequence number this server never delivered, n_index logidx_t and, for
+// each client, an int count and that many bytes it sent which were
+// read but not yet handled. The descriptors named here and in each
+// client_t are inherited across the exec.
+typedef struct {
+  int magic;                    // HANDOFF_MAGIC
+  int client_size;              // sizeof(client_t), refusing state from an incompatible server
+  long start;                   // microseconds since the epoch at which the handoff began
+  int join_fd;                  // as in server_t
+  int log_fd;
+  int capture_fd;
+  int n_clients;
+  int time_sec;
+  int n_joins;
+  long seq;
+  long window_first;            // seq of the first window entry that follows
+  int n_window;                 // number of window entries that follow
+  ckpt_t ckpt;                  // ckpt.n_index logidx_t follow the window
+  long n_polls;
+  long n_handled;
+  long capture_start;
+  long log_records;
+  long log_bytes;
+  long log_stored;
+  long log_usec;
+  long n_batches;
+  long n_batched;
+  long batch_wait;
+} handoff_t;
+
 // who_t: data to write into server log for current clients (ADVANCED)
 typedef struct {
   int n_clients;                   // number of clients on server
   char names[MAXCLIENTS][MAXNAME]; // names of clients
 } who_t;
 
+// blclient_t: connection of a headless client to a server for bots
+// and other programs, see blclient_funcs.c
+typedef struct blclient {
+  char server_name[MAXPATH];    // server joined
+  join_t join;                  // name joined as and the names of the FIFOs
+  int sendfd;                   // to_server FIFO, non-blocking
+  int recvfd;                   // to_client FIFO, non-blocking
+  nametab_t names;              // names of the session ids announced by the server
+  long last_seq;                // sequence number of the last broadcast received
+  long missed;                  // broadcasts lost just before the last one received
+  int joined;                   // flag: the server's announcement of this client's join has arrived
+  int shutdown;                 // flag: the server announced it is shutting down
+  char in[CATCHUP_BUF];         // bytes read from the server not yet decoded
+  int in_pos;                   // position of the next message in in
+  int in_len;                   // number of bytes in in
+  char out[BLCLIENT_OUTBUF];    // encoded messages waiting for room in the server's FIFO
+  int out_len;                  // number of bytes in out
+} blclient_t;
+
+// blclient_handler_t: callback receiving messages from blclient_dispatch()
+typedef void (*blclient_handler_t)(blclient_t *c, mesg_t *msg, void *arg);
+
 // simpio_t: data structure to manage terminal input/output for clients
 typedef struct{
   char buf[MAXLINE];            // line of text to read
@@ -94,6 +447,10 @@ typedef struct{
   int end_of_input;             // flag determining if end of input has been indicated
   FILE *infile;                 // FILE to read from for input, usually stdin
   FILE *outfile;                // FILE to write to for output, usually stdout
+  int bulk;                     // flag: input is not interactive, read it in large chunks
+  char chunk[SIMPIO_CHUNK];     // bulk mode: input read but not yet split into lines
+  int chunk_pos;                // bulk mode: start of the unsplit input in chunk
+  int chunk_len;                // bulk mode: end of the input in chunk
 } simpio_t;
 
 
@@ -104,6 +461,8 @@ void server_shutdown(server_t *server);
 int server_add_client(server_t *server, join_t *join);
 int server_remove_client(server_t *server, int idx);
 int server_broadcast(server_t *server, mesg_t *mesg);
+int server_deliver(server_t *server, mesg_t *mesg);
+void server_flush(server_t *server, int force);
 void server_check_sources(server_t *server);
 int server_join_ready(server_t *server);
 int server_handle_join(server_t *server);
@@ -113,12 +472,119 @@ void server_tick(server_t *server);
 void server_ping_clients(server_t *server);
 void server_remove_disconnected(server_t *server, int disconnect_secs);
 void server_write_who(server_t *server);
-void server_log_message(server_t *server, mesg_t *mesg);
+void server_log_message(server_t *server, mesg_t *mesg, msgbuf_t *buf);
+int server_catch_up(server_t *server, client_t *client, long last_seq);
+void server_checkpoint(server_t *server);
+void server_handoff(server_t *server, char *exe, char **argv);
+void server_resume(server_t *server, char *server_name, int fd);
 
 // client_funcs.c ADDED
 char *client_format_mesg(mesg_t *msg, char buf[MAXLINE+MAXNAME+8]); //ADDED
 int client_parse_last(char *msg_body); //ADDED
 int client_parse_who(char *msg_body);  //ADDED
+int client_read_last(int logfd, long from_off, mesg_t *last, int num);
+
+// log_funcs.c
+void logscan_open(logscan_t *scan, int fd, long off);
+void logscan_map(logscan_t *scan, char *base, long size, long off);
+void logscan_remap(logscan_t *scan, char *base, long size);
+int logscan_next(logscan_t *scan, mesg_t *mesg);
+void logscan_close(logscan_t *scan);
+int log_read_checkpoint(char *server_name, ckpt_t *ckpt, logidx_t **index);
+void log_write_checkpoint(char *server_name, ckpt_t *ckpt, logidx_t *index);
+long log_index_find(logidx_t *index, int n_index, long seq);
+
+// lz_funcs.c
+int lz_compress(const char *src, int len, char *dst);
+int lz_decompress(const char *src, int len, char *dst, int cap);
+
+// joinq_funcs.c
+joinq_t *joinq_create(char *server_name);
+joinq_t *joinq_open(char *server_name);
+void joinq_close(joinq_t *q);
+void joinq_unlink(char *server_name);
+int joinq_push(joinq_t *q, joinrec_t *rec);
+int joinq_pop(joinq_t *q, joinrec_t *rec);
+int joinq_join(char *server_name, joinrec_t *rec);
+void joinq_to_join(joinrec_t *rec, join_t *join);
+
+// uring_funcs.c
+uring_t *uring_open(int entries);
+void uring_close(uring_t *u);
+void uring_watch_client(uring_t *u, int id, int fd);
+void uring_unwatch_client(uring_t *u, int id);
+int uring_wait(uring_t *u, int join_fd, long timeout_usec);
+int uring_join_ready(uring_t *u);
+int uring_has_mesg(uring_t *u, int id);
+int uring_read_mesg(uring_t *u, int id, mesg_t *mesg);
+void uring_queue_write(uring_t *u, int fd, char *wire, int len);
+void uring_queue_log(uring_t *u, int fd, char *wire, int len, long off);
+int uring_flush(uring_t *u);
+long uring_enters(uring_t *u);
+void uring_quiesce(uring_t *u);
+int uring_buffered(uring_t *u, int id, char **buf);
+void uring_prefill(uring_t *u, int id, char *buf, int len);
+
+// fed_funcs.c
+fed_t *fed_open(server_t *server);
+void fed_close(server_t *server);
+int fed_pollfds(fed_t *fed, struct pollfd *pfds);
+int fed_check(fed_t *fed, struct pollfd *pfds, int n);
+void fed_handle(server_t *server);
+void fed_flush(fed_t *fed);
+void fed_join(fed_t *fed, int id, char *name);
+int fed_relay(server_t *server, mesg_t *mesg);
+void fed_delivered(server_t *server, mesg_t *mesg, msgbuf_t *buf);
+char *fed_member(fed_t *fed, int id);
+int fed_members(fed_t *fed, char names[][MAXNAME]);
+
+// search_funcs.c
+search_t *search_open(server_t *server);
+void search_add(search_t *s, mesg_t *mesg, long off);
+void search_save_later(search_t *s);
+int search_query(search_t *s, char *terms, searchhit_t *hits, int max, long *total);
+void search_close(search_t *s);
+
+// pool_funcs.c
+msgbuf_t *pool_get(int len);
+msgbuf_t *pool_ref(msgbuf_t *buf);
+void pool_put(msgbuf_t *buf);
+msgbuf_t *pool_encode(mesg_t *mesg);
+void pool_stats(poolstats_t *out);
+
+// span_funcs.c, used through the SPAN_ macros
+void span_open(void);
+long span_now(void);
+void span_record(const char *name, long start, int arg);
+void span_thread(const char *name);
+void span_dump(void);
+
+// blclient_funcs.c, built into libblather_client.a
+int blclient_join(blclient_t *c, char *server_name, char *name, long last_seq);
+int blclient_pollfds(blclient_t *c, struct pollfd pfds[2]);
+int blclient_room(blclient_t *c);
+int blclient_send(blclient_t *c, char *text);
+int blclient_flush(blclient_t *c);
+int blclient_recv(blclient_t *c, mesg_t *msg);
+int blclient_dispatch(blclient_t *c, blclient_handler_t handler, void *arg);
+int blclient_pending(blclient_t *c);
+int blclient_leave(blclient_t *c);
+void blclient_depart(blclient_t *c);
+void blclient_close(blclient_t *c);
+
+// mesg_funcs.c
+int mesg_encode(mesg_t *mesg, char buf[MAXWIRE]);
+int mesg_wire_len(mesg_t *mesg);
+int mesg_decode(char *buf, int len, mesg_t *mesg);
+int mesg_write(int fd, mesg_t *mesg);
+int mesg_read(int fd, mesg_t *mesg);
+unsigned int mesg_crc(char *wire, int len);
+void nametab_init(nametab_t *tab);
+int nametab_resolve(nametab_t *tab, mesg_t *mesg);
+
+// trace_funcs.c
+int trace_encode(trace_t *rec, mesg_t *mesg, char buf[MAXTRACE]);
+int trace_decode(char *buf, int len, trace_t *rec, mesg_t *mesg);
 
 // simpio.c
 void simpio_noncanonical_terminal_mode();
@@ -126,10 +592,14 @@ void simpio_reset_terminal_mode();
 void simpio_reset(simpio_t *simpio);
 void simpio_set_prompt(simpio_t *simpio, char *prompt);
 void simpio_get_char(simpio_t *simpio);
+int simpio_detect_bulk(simpio_t *simpio);
+int simpio_has_line(simpio_t *simpio);
+int simpio_get_lines(simpio_t *simpio, char lines[][MAXLINE], int max);
 void iprintf(simpio_t *simpio, char *fmt, ...);
 
 // util.c
 void check_fail(int condition, int perr, char *fmt, ...);
 void log_printf(char *fmt, ...);
 void dbg_printf(char *fmt, ...);
-void pause_for(long nanos, int secs);
\ No newline at end of file
+void pause_for(long nanos, int secs);
+long clock_usec();
\ No newline at end of file
@@ -0,0 +1,267 @@
+#include "blather.h"
+#include <sys/ioctl.h>
+
+// Headless client connections for bots and other programs, built into
+// libblather_client.a. A blclient_t is driven from a single threaded
+// event loop: poll() the descriptors from blclient_pollfds(), then
+// call blclient_flush() and take messages with blclient_recv() or
+// blclient_dispatch(). Neither FIFO ever blocks. Pings are answered
+// and unknown session ids looked up with the server without the
+// caller's involvement.
+
+static int blclient_count = 0;  // connections made by this process, to name FIFOs
+
+// Join server_name as name, asking for every broadcast after last_seq
+// if it is not 0. Returns 0 on success and -1 if the FIFOs cannot be
+// created or the server cannot be reached.
+int blclient_join(blclient_t *c, char *server_name, char *name, long last_seq) {
+  snprintf(c->server_name, MAXPATH, "%s", server_name);
+  nametab_init(&c->names);
+  c->last_seq = last_seq;
+  c->missed = 0;
+  c->joined = 0;
+  c->shutdown = 0;
+  c->in_pos = 0;
+  c->in_len = 0;
+  c->out_len = 0;
+  joinrec_t rec = {
+    .last_seq = last_seq,
+  };
+  snprintf(rec.name, MAXNAME, "%s", name);
+  snprintf(rec.fifo_prefix, JOINQ_PREFIX, "%d.%d", getpid(), blclient_count++);
+  joinq_to_join(&rec, &c->join);
+  mkfifo(c->join.to_client_fname, S_IRUSR | S_IWUSR);
+  mkfifo(c->join.to_server_fname, S_IRUSR | S_IWUSR);
+  c->recvfd = open(c->join.to_client_fname, O_RDWR | O_NONBLOCK);
+  c->sendfd = open(c->join.to_server_fname, O_RDWR | O_NONBLOCK);
+  if (c->recvfd == -1 || c->sendfd == -1 || joinq_join(server_name, &rec) != 0) {
+    blclient_close(c);
+    return -1;
+  }
+  return 0;
+}
+
+// Fill pfds with what c waits on: input from the server and, while
+// messages are queued for lack of room in the server's FIFO, that FIFO
+// becoming writable. Returns the number of entries filled, 1 or 2.
+int blclient_pollfds(blclient_t *c, struct pollfd pfds[2]) {
+  pfds[0].fd = c->recvfd;
+  pfds[0].events = POLLIN;
+  pfds[0].revents = 0;
+  if (c->out_len == 0)
+    return 1;
+  pfds[1].fd = c->sendfd;
+  pfds[1].events = POLLOUT;
+  pfds[1].revents = 0;
+  return 2;
+}
+
+// Returns the number of bytes free in the send queue of c. Each
+// message takes at most MAXWIRE.
+int blclient_room(blclient_t *c) {
+  return BLCLIENT_OUTBUF - c->out_len;
+}
+
+// Encode msg onto the end of the send queue. Returns 0 on success and
+// -1 if the queue has no room.
+static int blclient_queue(blclient_t *c, mesg_t *msg) {
+  if (blclient_room(c) < MAXWIRE)
+    return -1;
+  c->out_len += mesg_encode(msg, c->out + c->out_len);
+  return 0;
+}
+
+// Queue text to be sent to the server as a chat message. It is written
+// by the next blclient_flush(), so a burst of sends costs one write.
+// Returns 0 on success and -1 if the queue is full, in which case
+// wait for blclient_pollfds() to report the server's FIFO writable.
+// Room for one message is held back so that a client sending as fast
+// as it can still answers pings rather than being dropped.
+int blclient_send(blclient_t *c, char *text) {
+  if (blclient_room(c) < 2 * MAXWIRE)
+    return -1;
+  mesg_t msg = {
+    .kind = BL_MESG,
+    .name_id = NOID,            // the server fills in who sent it
+  };
+  snprintf(msg.body, MAXLINE, "%s", text);
+  return blclient_queue(c, &msg);
+}
+
+// Write as much of the send queue as the server's FIFO has room for.
+// Each write holds only whole messages and at most PIPE_BUF bytes so
+// that it is atomic. Returns the number of bytes still queued or -1 if
+// writing failed.
+int blclient_flush(blclient_t *c) {
+  int pos = 0;
+  while (pos < c->out_len) {
+    int len = 0;
+    while (pos + len < c->out_len) {
+      wire_t hdr;
+      memcpy(&hdr, c->out + pos + len, sizeof(wire_t));
+      int size = sizeof(wire_t) + hdr.body_len;
+      if (len + size > PIPE_BUF)
+        break;
+      len += size;
+    }
+    int bytes = write(c->sendfd, c->out + pos, len);
+    if (bytes == -1 && (errno == EAGAIN || errno == EINTR))
+      break;                    // server's FIFO is full; try again once writable
+    if (bytes != len)
+      return -1;
+    pos += len;
+  }
+  memmove(c->out, c->out + pos, c->out_len - pos);
+  c->out_len -= pos;
+  return c->out_len;
+}
+
+// Take the next message from the server into msg with its name
+// resolved. Reads the server's FIFO at most once so it never blocks.
+// Pings are answered and name announcements recorded rather than
+// returned, and broadcasts already received, as when rejoining, are
+// dropped. If the announcement of this client's own join is numbered
+// at or below c->last_seq the server's numbering has started over, as
+// after a restart without a log, and c->last_seq follows it back
+// rather than dropping everything until it catches up. c->missed is
+// set to the number of broadcasts lost just before msg. Returns 1 if
+// msg was filled, 0 if no whole message has arrived yet and -1 if the
+// server sent something malformed.
+int blclient_recv(blclient_t *c, mesg_t *msg) {
+  int did_read = 0;
+  while (1) {
+    int ret = mesg_decode(c->in + c->in_pos, c->in_len - c->in_pos, msg);
+    if (ret < 0)
+      return -1;
+    if (ret == 0) {
+      if (did_read)
+        return 0;
+      memmove(c->in, c->in + c->in_pos, c->in_len - c->in_pos);
+      c->in_len -= c->in_pos;
+      c->in_pos = 0;
+      int bytes = read(c->recvfd, c->in + c->in_len, CATCHUP_BUF - c->in_len);
+      if (bytes <= 0)
+        return 0;
+      c->in_len += bytes;
+      did_read = 1;
+      continue;
+    }
+    c->in_pos += ret;
+    if (nametab_resolve(&c->names, msg) != 0) {
+      // an id we were never told about; ask the server who it is
+      mesg_t req = {
+        .kind = BL_NAMEMAP,
+        .name_id = msg->name_id,
+      };
+      blclient_queue(c, &req);
+      blclient_flush(c);
+    }
+    if (msg->kind == BL_NAMEMAP)
+      continue;                 // only updates the name table
+    if (msg->kind == BL_PING) {
+      mesg_t pong = {
+        .kind = BL_PING,
+        .name_id = NOID,
+      };
+      blclient_queue(c, &pong); // a full queue misses one ping of several
+      blclient_flush(c);
+      continue;
+    }
+    c->missed = 0;
+    if (!c->joined && msg->kind == BL_JOINED && strcmp(msg->name, c->join.name) == 0) {
+      c->joined = 1;            // everything after it is live rather than caught up
+      if (msg->seq != 0 && msg->seq <= c->last_seq)
+        c->last_seq = msg->seq - 1;
+    }
+    if (msg->seq != 0) {
+      if (msg->seq <= c->last_seq)
+        continue;
+      if (c->last_seq != 0)
+        c->missed = msg->seq - c->last_seq - 1;
+      c->last_seq = msg->seq;
+    }
+    if (msg->kind == BL_SHUTDOWN)
+      c->shutdown = 1;
+    return 1;
+  }
+}
+
+// Pass every message that has arrived from the server to handler
+// along with arg, as blclient_recv() would return them. Returns the
+// number of messages handled or -1 if the server sent something
+// malformed.
+int blclient_dispatch(blclient_t *c, blclient_handler_t handler, void *arg) {
+  int count = 0, ret;
+  mesg_t msg;
+  while ((ret = blclient_recv(c, &msg)) == 1) {
+    handler(c, &msg, arg);
+    count++;
+  }
+  return ret < 0 ? -1 : count;
+}
+
+// Discards a message received while departing.
+static void blclient_ignore(blclient_t *c, mesg_t *msg, void *arg) {
+}
+
+// Returns the number of bytes sent to the server that it has not yet
+// read, counting those still queued, or -1 on error.
+int blclient_pending(blclient_t *c) {
+  int unread = 0;
+  if (ioctl(c->sendfd, FIONREAD, &unread) == -1)
+    return -1;
+  return c->out_len + unread;
+}
+
+// Queue a notice to the server that this client is leaving. Returns
+// 0 on success and -1 if the queue is full. Until the server has read
+// it, it keeps writing to this client and would block once the FIFO
+// filled, so keep receiving until blclient_pending() is 0 before
+// calling blclient_close().
+int blclient_leave(blclient_t *c) {
+  mesg_t msg = {
+    .kind = BL_DEPARTED,
+    .name_id = NOID,
+  };
+  return blclient_queue(c, &msg);
+}
+
+// Leave the server and close the connection, blocking until the
+// server has read the departure. Input is discarded meanwhile. Gives
+// up if the server makes no progress for a second.
+void blclient_depart(blclient_t *c) {
+  int queued = 0;
+  long left = -1;               // bytes the server had yet to read at the last check
+  long start = clock_usec();
+  while (clock_usec() - start < 1000000) {
+    if (!queued)
+      queued = blclient_leave(c) == 0;
+    if (blclient_flush(c) < 0)
+      break;
+    int pending = blclient_pending(c);
+    if (pending == -1 || (queued && pending == 0))
+      break;
+    if (pending != left) {
+      left = pending;
+      start = clock_usec();     // still going; give it another second
+    }
+    struct pollfd pfds[2];
+    int n = blclient_pollfds(c, pfds);
+    if (poll(pfds, n, 10) > 0)
+      blclient_dispatch(c, blclient_ignore, NULL);
+  }
+  blclient_close(c);
+}
+
+// Close and remove the FIFOs of c without notifying the server, as
+// after it has shut down.
+void blclient_close(blclient_t *c) {
+  if (c->recvfd != -1)
+    close(c->recvfd);
+  if (c->sendfd != -1)
+    close(c->sendfd);
+  c->recvfd = -1;
+  c->sendfd = -1;
+  unlink(c->join.to_client_fname);
+  unlink(c->join.to_server_fname);
+}
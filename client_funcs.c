@@ -19,6 +19,12 @@ char *client_format_mesg(mesg_t *msg, char buf[MAXLINE+MAXNAME+8]) {
     case BL_DISCONNECTED: //another user was disconnected (ping timed out)
       snprintf(buf, MAXLINE+MAXNAME+8, "-- %s DISCONNECTED --\n", msg->name);
     break;
+    case BL_FOUND: //ADVANCED: a logged message matching our %search, or the count of them
+      if (msg->name[0] != '\0')
+        snprintf(buf, MAXLINE+MAXNAME+8, "FOUND [%s] : %.*s\n", msg->name, MAXLINE-8, msg->body);
+      else
+        snprintf(buf, MAXLINE+MAXNAME+8, "-- %s --\n", msg->body);
+    break;
     default: 
       return NULL;
   }
@@ -41,4 +47,38 @@ int client_parse_who(char *buf) {
     return 1;
   }
   return 0;
-}
\ No newline at end of file
+}
+// Fill last[] with the final num messages of the log open on logfd,
+// oldest first, with their names resolved. The log only holds session
+// ids so it is read from from_off, the start of the log or an entry of
+// its index, to follow the records which name them. Returns the number
+// of messages placed in last[], which is less than num if the log is
+// shorter.
+int client_read_last(int logfd, long from_off, mesg_t *last, int num) {
+  nametab_t *tab = malloc(sizeof(nametab_t));
+  check_fail(tab == NULL, 1, "couldn't allocate a name table\n");
+  nametab_init(tab);
+  logscan_t scan;
+  logscan_open(&scan, logfd, from_off);
+  mesg_t msg;
+  int count = 0;
+  while (logscan_next(&scan, &msg) == 1) {  // stops at a partially appended record
+    nametab_resolve(tab, &msg);
+    if (msg.kind == BL_NAMEMAP || msg.kind == BL_SNAPSHOT)
+      continue;
+    last[count % num] = msg;
+    count++;
+  }
+  logscan_close(&scan);
+  free(tab);
+  if (count <= num)
+    return count;
+  // rotate the ring so that the oldest message comes first
+  mesg_t *ring = malloc(sizeof(mesg_t) * num);
+  check_fail(ring == NULL, 1, "couldn't allocate message buffer\n");
+  for (int i = 0; i < num; i++)
+    ring[i] = last[(count + i) % num];
+  memcpy(last, ring, sizeof(mesg_t) * num);
+  free(ring);
+  return num;
+}
@@ -0,0 +1,565 @@
+#include "blather.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Federation joins several bl_servers into one room. Start one with
+// BL_FEDERATE=leader and the others with BL_FEDERATE=<leader's name>;
+// followers connect to the leader's Unix socket "leader_name.sock"
+// and clients may join any of the servers.
+//
+// Ordering: the leader alone assigns sequence numbers. A follower
+// relays the broadcasts of its own clients (joins, messages,
+// departures) up to the leader instead of delivering them. The leader
+// sequences them along with its own and relays every sequenced
+// broadcast down to all followers, the one it came from included, so
+// every server delivers the same broadcasts in the same order under
+// the same numbers. Windows, logs and catching up work as they do
+// for a single server.
+//
+// Loops: records only travel up unsequenced and down sequenced. The
+// leader takes records from a follower only about that follower's own
+// members, followers never relay what they receive, and a follower
+// drops any broadcast numbered at or below one it has delivered.
+//
+// Presence: each server keeps the whole room's membership, giving
+// members of other servers session ids of its own so that its
+// clients, %who and its log see everyone. When a link is lost the
+// members behind it are disconnected; a follower which loses its
+// leader carries on alone.
+//
+// Records for each link are batched and written by fed_flush() once
+// per pass of the server's loop. Links never block; a batch grows
+// while the other server is slow to read.
+
+// link_t: a connection to another server of the room
+typedef struct {
+  int fd;                       // connected Unix socket, -1 if unused
+  int ready;                    // flag: poll() reported input or a hangup
+  char *out;                    // records waiting for the next fed_flush()
+  int out_len;                  // number of bytes in out
+  int out_max;                  // allocated length of out
+  char in[FED_INBUF];           // bytes read but not yet handled
+  int in_len;                   // number of bytes in in
+} link_t;
+
+// member_t: someone in the room as this server knows them
+typedef struct {
+  int used;                     // flag: the local session id names a member
+  int origin;                   // server number of the member's server
+  int origin_id;                // session id of the member on that server
+  char name[MAXNAME];           // name of the member
+} member_t;
+
+// fed_t: this server's part in a federated room
+struct fed {
+  int self;                     // this server's number, 0 for the leader
+  int leading;                  // flag: this server sequences broadcasts
+  int listen_fd;                // socket followers connect to, -1 unless leader
+  int accept_ready;             // flag: a follower is connecting
+  char sockname[MAXPATH+5];     // path of listen_fd
+  link_t up;                    // link to the leader, fd -1 when leading
+  link_t down[MAXPEERS];        // links to followers by server number - 1
+  member_t member[MAXCLIENTS];  // the room's members by local session id
+  pthread_mutex_t member_lock;  // held while member changes, for fed_members() on other threads
+  int local_id[MAXPEERS+1][MAXCLIENTS]; // local session id by origin and origin_id, -1 if none
+};
+
+static void link_open(link_t *l, int fd) {
+// Start using l for the connection on fd.
+  l->fd = fd;
+  l->ready = 0;
+  l->in_len = 0;
+  l->out_len = 0;
+  if (l->out == NULL) {
+    l->out_max = FED_OUTBUF;
+    l->out = malloc(l->out_max);
+    check_fail(l->out == NULL, 1, "couldn't allocate a federation link\n");
+  }
+}
+
+static void link_close(link_t *l) {
+// Close l, discarding whatever is batched or unread.
+  if (l->fd != -1)
+    close(l->fd);
+  l->fd = -1;
+  l->ready = 0;
+  l->in_len = 0;
+  l->out_len = 0;
+}
+
+static void link_queue(link_t *l, relay_t *rel, char *wire, int len) {
+// Append a record to the batch for l.
+  int need = l->out_len + sizeof(relay_t) + len;
+  if (need > l->out_max) {
+    while (l->out_max < need)
+      l->out_max *= 2;
+    l->out = realloc(l->out, l->out_max);
+    check_fail(l->out == NULL, 1, "couldn't grow a federation link\n");
+  }
+  memcpy(l->out + l->out_len, rel, sizeof(relay_t));
+  memcpy(l->out + l->out_len + sizeof(relay_t), wire, len);
+  l->out_len = need;
+}
+
+static void link_flush(link_t *l) {
+// Write as much of the batch for l as its socket takes. A failed link
+// is noticed when reading from it.
+  int pos = 0;
+  while (pos < l->out_len) {
+    int bytes = send(l->fd, l->out + pos, l->out_len - pos, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (bytes <= 0)
+      break;
+    pos += bytes;
+  }
+  memmove(l->out, l->out + pos, l->out_len - pos);
+  l->out_len -= pos;
+}
+
+static int link_read(link_t *l) {
+// Read what has arrived on l. Returns 0 if the link has closed or
+// failed and 1 otherwise.
+  int bytes = recv(l->fd, l->in + l->in_len, FED_INBUF - l->in_len, MSG_DONTWAIT);
+  if (bytes == 0)
+    return 0;
+  if (bytes == -1)
+    return errno == EAGAIN || errno == EINTR;
+  l->in_len += bytes;
+  return 1;
+}
+
+static int link_next(link_t *l, int *pos, relay_t *rel, mesg_t *msg) {
+// Decode the record at *pos of the input of l and move past it.
+// Returns 1 if a record was decoded, 0 if no whole record is buffered
+// and -1 if the bytes are not a valid record. An origin_id of NOID
+// marks a broadcast the leader sequenced about no known member.
+  if (l->in_len - *pos < sizeof(relay_t))
+    return 0;
+  memcpy(rel, l->in + *pos, sizeof(relay_t));
+  int ret = mesg_decode(l->in + *pos + sizeof(relay_t), l->in_len - *pos - sizeof(relay_t), msg);
+  if (ret <= 0)
+    return ret;
+  if (rel->origin < 0 || rel->origin > MAXPEERS || rel->origin_id < NOID || rel->origin_id >= MAXCLIENTS)
+    return -1;
+  *pos += sizeof(relay_t) + ret;
+  return 1;
+}
+
+static void link_consumed(link_t *l, int pos) {
+// Discard the first pos bytes of the input of l.
+  memmove(l->in, l->in + pos, l->in_len - pos);
+  l->in_len -= pos;
+}
+
+static int member_add(fed_t *fed, int origin, int origin_id, char *name) {
+// Give a member of the given server a session id of this server,
+// unless it has one. Returns the id or -1 if all are taken.
+  int id = fed->local_id[origin][origin_id];
+  if (id != -1)
+    return id;
+  for (id = 0; id < MAXCLIENTS && fed->member[id].used; id++)
+    ;
+  if (id == MAXCLIENTS)
+    return -1;
+  member_t *m = fed->member + id;
+  pthread_mutex_lock(&fed->member_lock);
+  m->used = 1;
+  m->origin = origin;
+  m->origin_id = origin_id;
+  snprintf(m->name, MAXNAME, "%s", name);
+  pthread_mutex_unlock(&fed->member_lock);
+  fed->local_id[origin][origin_id] = id;
+  return id;
+}
+
+static void member_drop(fed_t *fed, int id) {
+// Forget the member holding the given session id.
+  member_t *m = fed->member + id;
+  if (!m->used)
+    return;
+  fed->local_id[m->origin][m->origin_id] = -1;
+  pthread_mutex_lock(&fed->member_lock);
+  m->used = 0;
+  pthread_mutex_unlock(&fed->member_lock);
+}
+
+static int fed_lookup(fed_t *fed, relay_t *rel, mesg_t *msg) {
+// Fill in the session id and name under which this server knows the
+// member a record is about, first adding those who join. Returns 0 on
+// success and -1 if the member is unknown or there is no room.
+  if (rel->origin_id == NOID)
+    return -1;
+  int id = fed->local_id[rel->origin][rel->origin_id];
+  if (id == -1 && msg->kind == BL_JOINED)
+    id = member_add(fed, rel->origin, rel->origin_id, msg->name);
+  if (id == -1)
+    return -1;
+  msg->name_id = id;
+  snprintf(msg->name, MAXNAME, "%s", fed->member[id].name);
+  return 0;
+}
+
+static int fed_connect(fed_t *fed, char *leader) {
+// Connect to the leader's socket and take its greeting: a BL_JOINED
+// for each member of the room followed by a BL_PEERED carrying this
+// server's number and the latest sequence number. Returns the
+// sequence number or -1 on failure.
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s.sock", leader);
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+    close(fd);
+    return -1;
+  }
+  link_open(&fed->up, fd);
+  while (1) {
+    int bytes = read(fd, fed->up.in + fed->up.in_len, FED_INBUF - fed->up.in_len);
+    if (bytes <= 0)
+      return -1;
+    fed->up.in_len += bytes;
+    int pos = 0, ret;
+    relay_t rel;
+    mesg_t msg;
+    while ((ret = link_next(&fed->up, &pos, &rel, &msg)) == 1) {
+      if (msg.kind == BL_JOINED) {
+        member_add(fed, rel.origin, rel.origin_id, msg.name);
+      } else if (msg.kind == BL_PEERED) {
+        fed->self = msg.name_id;
+        link_consumed(&fed->up, pos); // broadcasts may follow
+        return msg.seq;
+      }
+    }
+    if (ret < 0)
+      return -1;
+    link_consumed(&fed->up, pos);
+  }
+}
+
+fed_t *fed_open(server_t *server) {
+// Set up federation as selected by BL_FEDERATE: "leader" to listen
+// for followers on "server_name.sock" or the name of the leader to
+// follow. Returns NULL if BL_FEDERATE is not set.
+  char *mode = getenv("BL_FEDERATE");
+  if (mode == NULL)
+    return NULL;
+  fed_t *fed = calloc(1, sizeof(fed_t));
+  check_fail(fed == NULL, 1, "couldn't allocate federation state\n");
+  memset(fed->local_id, -1, sizeof(fed->local_id));
+  pthread_mutex_init(&fed->member_lock, NULL);
+  fed->up.fd = -1;
+  for (int k = 0; k < MAXPEERS; k++)
+    fed->down[k].fd = -1;
+  fed->listen_fd = -1;
+  if (strcmp(mode, "leader") == 0) {
+    fed->leading = 1;
+    fed->self = 0;
+    snprintf(fed->sockname, MAXPATH+5, "%s.sock", server->server_name);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    check_fail(strlen(fed->sockname) >= sizeof(addr.sun_path), 0, "federation socket name %s is too long\n", fed->sockname);
+    strcpy(addr.sun_path, fed->sockname);
+    unlink(fed->sockname);
+    fed->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    check_fail(fed->listen_fd == -1, 1, "couldn't create federation socket\n");
+    check_fail(bind(fed->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1, 1,
+               "couldn't bind federation socket %s\n", fed->sockname);
+    check_fail(listen(fed->listen_fd, MAXPEERS) == -1, 1, "couldn't listen on %s\n", fed->sockname);
+    log_printf("leading a federation on %s\n", fed->sockname);
+    return fed;
+  }
+  long seq = fed_connect(fed, mode);
+  check_fail(seq == -1, 1, "couldn't join the federation led by %s\n", mode);
+  if (seq < server->seq)
+    log_printf("leader's sequence number %ld is behind this server's log at %ld\n", seq, server->seq);
+  server->seq = seq;
+  log_printf("following %s as server %d of the federation, %ld broadcasts in\n", mode, fed->self, seq);
+  return fed;
+}
+
+void fed_close(server_t *server) {
+// Leave the federation, closing every link.
+  fed_t *fed = server->fed;
+  link_close(&fed->up);
+  free(fed->up.out);
+  for (int k = 0; k < MAXPEERS; k++) {
+    link_close(&fed->down[k]);
+    free(fed->down[k].out);
+  }
+  if (fed->listen_fd != -1) {
+    close(fed->listen_fd);
+    unlink(fed->sockname);
+  }
+  pthread_mutex_destroy(&fed->member_lock);
+  free(fed);
+  server->fed = NULL;
+}
+
+// Fill pfds with the federation's descriptors to poll() along with
+// the join FIFO and clients: the listening socket and every link,
+// which is also watched for room to write while records are batched
+// for it. Returns the number of entries filled.
+int fed_pollfds(fed_t *fed, struct pollfd *pfds) {
+  int n = 0;
+  if (fed->listen_fd != -1) {
+    pfds[n].fd = fed->listen_fd;
+    pfds[n].events = POLLIN;
+    n++;
+  }
+  for (int k = -1; k < MAXPEERS; k++) {
+    link_t *l = k == -1 ? &fed->up : &fed->down[k];
+    if (l->fd == -1)
+      continue;
+    pfds[n].fd = l->fd;
+    pfds[n].events = POLLIN | (l->out_len > 0 ? POLLOUT : 0);
+    n++;
+  }
+  return n;
+}
+
+// Note which of the n entries filled by fed_pollfds() poll() found
+// ready. Returns 1 if fed_handle() has anything to do.
+int fed_check(fed_t *fed, struct pollfd *pfds, int n) {
+  int i = 0, any = 0;
+  if (fed->listen_fd != -1) {
+    fed->accept_ready = (pfds[i++].revents & POLLIN) != 0;
+    any |= fed->accept_ready;
+  }
+  for (int k = -1; k < MAXPEERS && i < n; k++) {
+    link_t *l = k == -1 ? &fed->up : &fed->down[k];
+    if (l->fd == -1)
+      continue;
+    l->ready = (pfds[i++].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+    any |= l->ready;
+  }
+  return any;
+}
+
+static void fed_accept(server_t *server) {
+// Take the followers connecting to the leader, greeting each with
+// the room's members and its server number.
+  fed_t *fed = server->fed;
+  int fd;
+  while ((fd = accept(fed->listen_fd, NULL, NULL)) != -1) {
+    int k = 0;
+    while (k < MAXPEERS && fed->down[k].fd != -1)
+      k++;
+    if (k == MAXPEERS) {
+      log_printf("federation is full, turning a follower away\n");
+      close(fd);
+      continue;
+    }
+    link_t *l = &fed->down[k];
+    link_open(l, fd);
+    char buf[MAXWIRE];
+    for (int id = 0; id < MAXCLIENTS; id++) {
+      member_t *m = fed->member + id;
+      if (!m->used)
+        continue;
+      relay_t rel = { .origin = m->origin, .origin_id = m->origin_id };
+      mesg_t msg = {
+        .kind = BL_JOINED,
+        .name_id = id,
+      };
+      snprintf(msg.name, MAXNAME, "%s", m->name);
+      link_queue(l, &rel, buf, mesg_encode(&msg, buf));
+    }
+    relay_t rel = { .origin = 0, .origin_id = 0 };
+    mesg_t peered = {
+      .kind = BL_PEERED,
+      .seq = server->seq,
+      .name_id = k + 1,
+    };
+    link_queue(l, &rel, buf, mesg_encode(&peered, buf));
+    log_printf("server %d joined the federation\n", k + 1);
+  }
+}
+
+static void fed_lost_follower(server_t *server, int k) {
+// The leader lost follower k: everyone connected to it is disconnected.
+  fed_t *fed = server->fed;
+  log_printf("lost server %d of the federation\n", k + 1);
+  link_close(&fed->down[k]);
+  for (int id = 0; id < MAXCLIENTS; id++) {
+    if (fed->member[id].used && fed->member[id].origin == k + 1) {
+      mesg_t msg = {
+        .kind = BL_DISCONNECTED,
+        .name_id = id,
+      };
+      snprintf(msg.name, MAXNAME, "%s", fed->member[id].name);
+      server_broadcast(server, &msg);
+    }
+  }
+}
+
+static void fed_lost_leader(server_t *server) {
+// A follower lost its leader and carries on alone: members of other
+// servers are disconnected and departures of its own clients which
+// the leader never sequenced are completed.
+  fed_t *fed = server->fed;
+  log_printf("lost the federation's leader, carrying on alone\n");
+  link_close(&fed->up);
+  fed->leading = 1;
+  for (int id = 0; id < MAXCLIENTS; id++) {
+    member_t *m = fed->member + id;
+    if (!m->used)
+      continue;
+    int here = 0;
+    for (int i = 0; i < server->n_clients; i++)
+      here |= server->client[i].id == id;
+    if (here)
+      continue;
+    mesg_t msg = {
+      .kind = m->origin == fed->self ? BL_DEPARTED : BL_DISCONNECTED,
+      .name_id = id,
+    };
+    snprintf(msg.name, MAXNAME, "%s", m->name);
+    server_broadcast(server, &msg);
+  }
+}
+
+static void fed_from_follower(server_t *server, int k, relay_t *rel, mesg_t *msg) {
+// The leader sequences a broadcast relayed by follower k. Anything
+// about members of other servers or already sequenced is dropped.
+  if (rel->origin != k + 1 || msg->seq != 0)
+    return;
+  if (msg->kind != BL_MESG && msg->kind != BL_JOINED && msg->kind != BL_DEPARTED && msg->kind != BL_DISCONNECTED)
+    return;
+  if (fed_lookup(server->fed, rel, msg) != 0)
+    return;
+  server_broadcast(server, msg);
+}
+
+static void fed_from_leader(server_t *server, relay_t *rel, mesg_t *msg) {
+// A follower delivers a broadcast sequenced by the leader. One about a
+// member it does not know is skipped but its sequence number is still
+// used up, leaving the window slot for it empty.
+  if (msg->seq <= server->seq)
+    return;
+  if (fed_lookup(server->fed, rel, msg) != 0) {
+    log_printf("dropped broadcast %ld about an unknown member\n", msg->seq);
+    server->seq = msg->seq;
+    return;
+  }
+  server->seq = msg->seq;
+  server_deliver(server, msg);
+}
+
+void fed_handle(server_t *server) {
+// Call when server->fed_ready is set. Accepts connecting followers and
+// handles every record which has arrived on the links.
+  fed_t *fed = server->fed;
+  server->fed_ready = 0;
+  if (fed->accept_ready) {
+    fed->accept_ready = 0;
+    fed_accept(server);
+  }
+  for (int k = -1; k < MAXPEERS; k++) {
+    link_t *l = k == -1 ? &fed->up : &fed->down[k];
+    if (l->fd == -1 || !l->ready)
+      continue;
+    l->ready = 0;
+    int ok = link_read(l);
+    int pos = 0, ret = 0;
+    relay_t rel;
+    mesg_t msg;
+    while (ok && (ret = link_next(l, &pos, &rel, &msg)) == 1) {
+      if (k == -1)
+        fed_from_leader(server, &rel, &msg);
+      else
+        fed_from_follower(server, k, &rel, &msg);
+    }
+    if (ok && ret < 0) {
+      log_printf("garbled record on a federation link\n");
+      ok = 0;
+    }
+    if (!ok && k == -1)
+      fed_lost_leader(server);
+    else if (!ok)
+      fed_lost_follower(server, k);
+    else
+      link_consumed(l, pos);
+  }
+}
+
+void fed_flush(fed_t *fed) {
+// Write out the records batched for every link.
+  for (int k = -1; k < MAXPEERS; k++) {
+    link_t *l = k == -1 ? &fed->up : &fed->down[k];
+    if (l->fd != -1 && l->out_len > 0)
+      link_flush(l);
+  }
+}
+
+void fed_join(fed_t *fed, int id, char *name) {
+// Record that a client of this server joined under the given session
+// id. The id stays reserved until its departure has been sequenced.
+  member_t *m = fed->member + id;
+  pthread_mutex_lock(&fed->member_lock);
+  m->used = 1;
+  m->origin = fed->self;
+  m->origin_id = id;
+  snprintf(m->name, MAXNAME, "%s", name);
+  pthread_mutex_unlock(&fed->member_lock);
+  fed->local_id[fed->self][id] = id;
+}
+
+int fed_relay(server_t *server, mesg_t *mesg) {
+// Called by server_broadcast() for each broadcast to be sequenced. A
+// follower relays it to its leader and returns 1: it is delivered when
+// it comes back sequenced. The leader returns 0 to sequence it itself.
+  fed_t *fed = server->fed;
+  if (fed->leading)
+    return 0;
+  relay_t rel = { .origin = fed->self, .origin_id = mesg->name_id };
+  if (mesg->name_id >= 0 && mesg->name_id < MAXCLIENTS && fed->member[mesg->name_id].used) {
+    rel.origin = fed->member[mesg->name_id].origin;
+    rel.origin_id = fed->member[mesg->name_id].origin_id;
+  }
+  char buf[MAXWIRE];
+  link_queue(&fed->up, &rel, buf, mesg_encode(mesg, buf));
+  return 1;
+}
+
+void fed_delivered(server_t *server, mesg_t *mesg, msgbuf_t *buf) {
+// Called by server_deliver() once a sequenced broadcast has gone out
+// to this server's clients, with the pooled buffer it was encoded in.
+// The leader relays it to every follower, even when it is about no
+// known member, so that no follower misses a sequence number.
+// Departed members are forgotten.
+  fed_t *fed = server->fed;
+  int id = mesg->name_id;
+  int known = id >= 0 && id < MAXCLIENTS && fed->member[id].used;
+  if (fed->leading) {
+    relay_t rel = { .origin = fed->self, .origin_id = NOID };
+    if (known) {
+      rel.origin = fed->member[id].origin;
+      rel.origin_id = fed->member[id].origin_id;
+    }
+    for (int k = 0; k < MAXPEERS; k++) {
+      if (fed->down[k].fd != -1)
+        link_queue(&fed->down[k], &rel, buf->data, buf->len);
+    }
+  }
+  if (known && (mesg->kind == BL_DEPARTED || mesg->kind == BL_DISCONNECTED))
+    member_drop(fed, id);
+}
+
+// Returns the name of the member holding the given session id or
+// NULL if the id is free. For the main thread, which alone changes
+// the members.
+char *fed_member(fed_t *fed, int id) {
+  return fed->member[id].used ? fed->member[id].name : NULL;
+}
+
+// Copy the name of every member of the room into names, in order of
+// session id. Returns how many there are. Safe on any thread.
+int fed_members(fed_t *fed, char names[][MAXNAME]) {
+  int n = 0;
+  pthread_mutex_lock(&fed->member_lock);
+  for (int id = 0; id < MAXCLIENTS; id++) {
+    if (fed->member[id].used)
+      snprintf(names[n++], MAXNAME, "%s", fed->member[id].name);
+  }
+  pthread_mutex_unlock(&fed->member_lock);
+  return n;
+}
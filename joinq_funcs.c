@@ -0,0 +1,135 @@
+#include "blather.h"
+#include <sys/mman.h>
+
+// The join queue is a bounded multi-producer, single-consumer ring in
+// POSIX shared memory "/server_name.joinq". Each slot carries a
+// sequence number: a producer may claim the slot for position pos when
+// it equals pos, publishes its record by setting it to pos+1, and the
+// server frees the slot for the next lap by setting it to
+// pos+JOINQ_SLOTS. Producers race only on the tail counter with a
+// compare-and-swap, so concurrent joiners never serialize on a lock.
+
+static void joinq_shm_name(char *server_name, char shmname[MAXPATH+7]) {
+  snprintf(shmname, MAXPATH+7, "/%s.joinq", server_name);
+}
+
+static joinq_t *joinq_map(char *server_name, int create) {
+  char shmname[MAXPATH+7];
+  joinq_shm_name(server_name, shmname);
+  int fd = shm_open(shmname, create ? O_CREAT | O_RDWR | O_TRUNC : O_RDWR, S_IRUSR | S_IWUSR);
+  if (fd == -1)
+    return NULL;
+  if (create && ftruncate(fd, sizeof(joinq_t)) == -1) {
+    close(fd);
+    return NULL;
+  }
+  joinq_t *q = mmap(NULL, sizeof(joinq_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  return q == MAP_FAILED ? NULL : q;
+}
+
+// Create the join queue for the server, replacing any left over from
+// an earlier run. Returns NULL on failure.
+joinq_t *joinq_create(char *server_name) {
+  char shmname[MAXPATH+7];
+  joinq_shm_name(server_name, shmname);
+  shm_unlink(shmname);
+  joinq_t *q = joinq_map(server_name, 1);
+  if (q == NULL)
+    return NULL;
+  for (long i = 0; i < JOINQ_SLOTS; i++)
+    q->slot[i].seq = i;
+  q->head = 0;
+  q->tail = 0;
+  __atomic_store_n(&q->magic, JOINQ_MAGIC, __ATOMIC_RELEASE);
+  return q;
+}
+
+// Map the join queue of a running server. Returns NULL if the server
+// has not created it.
+joinq_t *joinq_open(char *server_name) {
+  joinq_t *q = joinq_map(server_name, 0);
+  if (q != NULL && __atomic_load_n(&q->magic, __ATOMIC_ACQUIRE) != JOINQ_MAGIC) {
+    joinq_close(q);
+    return NULL;
+  }
+  return q;
+}
+
+// Unmap the join queue.
+void joinq_close(joinq_t *q) {
+  munmap(q, sizeof(joinq_t));
+}
+
+// Remove the shared memory of the server's join queue.
+void joinq_unlink(char *server_name) {
+  char shmname[MAXPATH+7];
+  joinq_shm_name(server_name, shmname);
+  shm_unlink(shmname);
+}
+
+// Publish a join request. Safe to call from any number of processes
+// at once. Returns 0 on success and -1 if the queue is full.
+int joinq_push(joinq_t *q, joinrec_t *rec) {
+  long pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  joinslot_t *slot;
+  while (1) {
+    slot = &q->slot[pos % JOINQ_SLOTS];
+    long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq == pos) {
+      if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;                  // claimed; on failure pos now holds the current tail
+    } else if (seq < pos) {
+      return -1;                // the server has not freed this slot from the last lap
+    } else {
+      pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+  }
+  slot->rec = *rec;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+// Take the oldest published join request. Only the server may call
+// this. Returns 1 if a request was placed in rec and 0 if there is
+// none, including when the next slot is claimed but not yet published.
+int joinq_pop(joinq_t *q, joinrec_t *rec) {
+  long pos = q->head;
+  joinslot_t *slot = &q->slot[pos % JOINQ_SLOTS];
+  if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+    return 0;
+  *rec = slot->rec;
+  __atomic_store_n(&slot->seq, pos + JOINQ_SLOTS, __ATOMIC_RELEASE);
+  q->head = pos + 1;
+  return 1;
+}
+
+// Join the named server: publish rec in its join queue, waiting while
+// the queue is full, then ring the doorbell by writing one byte to the
+// server's join FIFO so that its poll() wakes up. Returns 0 on success
+// and -1 if the server's queue or FIFO cannot be opened.
+int joinq_join(char *server_name, joinrec_t *rec) {
+  joinq_t *q = joinq_open(server_name);
+  if (q == NULL)
+    return -1;
+  while (joinq_push(q, rec) != 0)
+    pause_for(1000000, 0);      // server is behind on joins; give it a millisecond
+  joinq_close(q);
+  char fifo_name[MAXPATH+5];
+  snprintf(fifo_name, MAXPATH+5, "%s.fifo", server_name);
+  int fd = open(fifo_name, O_WRONLY | O_NONBLOCK);
+  if (fd == -1)
+    return -1;
+  char bell = 1;
+  int bytes = write(fd, &bell, 1); // a full FIFO already has the server's attention
+  close(fd);
+  return bytes == 1 || errno == EAGAIN ? 0 : -1;
+}
+
+// Fill in the join_t the server adds a client with from a join request.
+void joinq_to_join(joinrec_t *rec, join_t *join) {
+  snprintf(join->name, MAXNAME, "%s", rec->name);
+  snprintf(join->to_client_fname, MAXPATH, "%s.client.fifo", rec->fifo_prefix);
+  snprintf(join->to_server_fname, MAXPATH, "%s.server.fifo", rec->fifo_prefix);
+  join->last_seq = rec->last_seq;
+}
@@ -0,0 +1,199 @@
+#include "blather.h"
+
+// Prepare scan to read the records of the log open on fd starting at
+// offset off.
+void logscan_open(logscan_t *scan, int fd, long off) {
+  scan->fd = fd;
+  scan->buf = malloc(SCAN_BUF);
+  check_fail(scan->buf == NULL, 1, "couldn't allocate log buffer\n");
+  scan->pos = 0;
+  scan->len = 0;
+  scan->off = off;
+  scan->rec_off = 0;
+  scan->rec_crc = 0;
+  scan->block = NULL;
+  scan->block_pos = 0;
+  scan->block_len = 0;
+  lseek(fd, off, SEEK_SET);
+}
+
+// Prepare scan to read the records of a log of size bytes mapped into
+// memory at base, starting at offset off. Records are decoded in place
+// so nothing is copied but the bodies of the records returned.
+void logscan_map(logscan_t *scan, char *base, long size, long off) {
+  scan->fd = -1;
+  scan->buf = base;
+  scan->pos = off;
+  scan->len = size;
+  scan->off = off;
+  scan->rec_off = 0;
+  scan->rec_crc = 0;
+  scan->block = NULL;
+  scan->block_pos = 0;
+  scan->block_len = 0;
+}
+
+// Carry on with a mapped log which has grown to size bytes and been
+// mapped again at base, from where scan left off.
+void logscan_remap(logscan_t *scan, char *base, long size) {
+  scan->buf = base;
+  scan->len = size;
+}
+
+// Check and expand the BL_LOGBLOCK at buf[pos] so that its records are
+// returned next. Returns 1 if it was expanded, 0 if it is not yet
+// buffered in full and -1 if it is corrupt.
+static int logscan_block(logscan_t *scan) {
+  if (scan->len - scan->pos < sizeof(logblock_t))
+    return 0;
+  logblock_t hdr;
+  memcpy(&hdr, scan->buf + scan->pos, sizeof(logblock_t));
+  if (hdr.raw_len < 0 || hdr.raw_len > LOGZ_MAXRAW || hdr.comp_len < 0 || hdr.comp_len > LZ_BOUND(LOGZ_MAXRAW))
+    return -1;
+  int len = sizeof(logblock_t) + hdr.comp_len;
+  if (scan->len - scan->pos < len)
+    return 0;
+  if (mesg_crc(scan->buf + scan->pos, len) != hdr.crc)
+    return -1;
+  if (scan->block == NULL) {
+    scan->block = malloc(LOGZ_MAXRAW);
+    check_fail(scan->block == NULL, 1, "couldn't allocate log block buffer\n");
+  }
+  int raw = lz_decompress(scan->buf + scan->pos + sizeof(logblock_t), hdr.comp_len, scan->block, LOGZ_MAXRAW);
+  if (raw != hdr.raw_len)
+    return -1;
+  scan->block_pos = 0;
+  scan->block_len = raw;
+  scan->block_off = scan->off;
+  scan->block_crc = hdr.crc;
+  scan->pos += len;
+  scan->off += len;
+  return 1;
+}
+
+// Read the next record of the log into mesg, refilling the buffer in
+// SCAN_BUF chunks as needed. The record's offset and checksum are left
+// in rec_off and rec_crc. Returns 1 if a record was read, 0 at a
+// clean end of the log and -1 if the remaining bytes are a partial or
+// corrupt record, such as one torn by a crash or still being written.
+//
+// The records of a BL_LOGBLOCK are returned as if they had been logged
+// plainly, except that rec_off and rec_crc are those of the block and
+// off only moves past it once it has been expanded, so a block is
+// verified, recovered and indexed as a whole.
+int logscan_next(logscan_t *scan, mesg_t *mesg) {
+  while (1) {
+    if (scan->block_pos < scan->block_len) {
+      int ret = mesg_decode(scan->block + scan->block_pos, scan->block_len - scan->block_pos, mesg);
+      if (ret <= 0)
+        return -1;              // blocks only hold whole records
+      scan->rec_off = scan->block_off;
+      scan->rec_crc = scan->block_crc;
+      scan->block_pos += ret;
+      return 1;
+    }
+    int ret, kind = 0;
+    if (scan->len - scan->pos >= sizeof(wire_t))
+      memcpy(&kind, scan->buf + scan->pos + offsetof(wire_t, kind), sizeof(int));
+    if (kind == BL_LOGBLOCK) {
+      ret = logscan_block(scan);
+      if (ret > 0)
+        continue;
+    } else {
+      long avail = scan->len - scan->pos; //a mapped log may be longer than an int counts
+      ret = mesg_decode(scan->buf + scan->pos, avail < SCAN_BUF ? avail : SCAN_BUF, mesg);
+    }
+    if (ret > 0) {
+      wire_t hdr;
+      memcpy(&hdr, scan->buf + scan->pos, sizeof(wire_t));
+      scan->rec_off = scan->off;
+      scan->rec_crc = hdr.crc;
+      scan->pos += ret;
+      scan->off += ret;
+      return 1;
+    }
+    if (ret < 0)
+      return -1;
+    if (scan->fd == -1)         // a mapped log has no more to read
+      return scan->pos == scan->len ? 0 : -1;
+    // only part of a record is buffered; shift it down and read more
+    memmove(scan->buf, scan->buf + scan->pos, scan->len - scan->pos);
+    scan->len -= scan->pos;
+    scan->pos = 0;
+    int bytes = read(scan->fd, scan->buf + scan->len, SCAN_BUF - scan->len);
+    if (bytes <= 0)
+      return scan->len == 0 ? 0 : -1;
+    scan->len += bytes;
+  }
+}
+
+// Release the buffers of scan. The log's file descriptor or mapping
+// stays open.
+void logscan_close(logscan_t *scan) {
+  if (scan->fd != -1)
+    free(scan->buf);
+  scan->buf = NULL;
+  free(scan->block);
+  scan->block = NULL;
+}
+
+// Load the checkpoint "server_name.ckpt" into ckpt and a newly
+// allocated *index which the caller must free(). Returns 0 on success
+// and -1 if there is no usable checkpoint.
+int log_read_checkpoint(char *server_name, ckpt_t *ckpt, logidx_t **index) {
+  char ckptname[MAXPATH+5];
+  snprintf(ckptname, MAXPATH+5, "%s.ckpt", server_name);
+  int fd = open(ckptname, O_RDONLY);
+  if (fd == -1)
+    return -1;
+  int bytes = read(fd, ckpt, sizeof(ckpt_t));
+  if (bytes != sizeof(ckpt_t) || ckpt->magic != CKPT_MAGIC || ckpt->n_index < 0) {
+    close(fd);
+    return -1;
+  }
+  int size = sizeof(logidx_t) * ckpt->n_index;
+  *index = malloc(size + sizeof(logidx_t));
+  check_fail(*index == NULL, 1, "couldn't allocate log index\n");
+  bytes = read(fd, *index, size);
+  close(fd);
+  if (bytes != size) {
+    free(*index);
+    *index = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+// Atomically replace the checkpoint "server_name.ckpt" with ckpt
+// followed by its n_index index entries.
+void log_write_checkpoint(char *server_name, ckpt_t *ckpt, logidx_t *index) {
+  char ckptname[MAXPATH+5];
+  char tmpname[MAXPATH+9];
+  snprintf(ckptname, MAXPATH+5, "%s.ckpt", server_name);
+  snprintf(tmpname, MAXPATH+9, "%s.ckpt.tmp", server_name);
+  int fd = open(tmpname, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+  check_fail(fd == -1, 1, "couldn't open checkpoint %s\n", tmpname);
+  ckpt->magic = CKPT_MAGIC;
+  int size = sizeof(logidx_t) * ckpt->n_index;
+  int bytes = write(fd, ckpt, sizeof(ckpt_t));
+  check_fail(bytes != sizeof(ckpt_t), 1, "couldn't write checkpoint\n");
+  bytes = write(fd, index, size);
+  check_fail(bytes != size, 1, "couldn't write checkpoint\n");
+  close(fd);
+  check_fail(rename(tmpname, ckptname) == -1, 1, "couldn't replace checkpoint %s\n", ckptname);
+}
+
+// Find where to start reading the log to see every record after
+// sequence number seq: the offset of the last index entry logged at
+// or before seq, or the first record if there is none.
+long log_index_find(logidx_t *index, int n_index, long seq) {
+  int lo = 0, hi = n_index;     // entries below lo have index[i].seq <= seq
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (index[mid].seq <= seq)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo == 0 ? sizeof(who_t) : index[lo-1].off;
+}
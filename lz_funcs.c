@@ -0,0 +1,129 @@
+#include "blather.h"
+
+// A small LZ77 codec for blocks of the compressed log (BL_LOGZ), in
+// the style of LZ4. Compressed data is a series of sequences, each a
+// token byte followed by literals and a match:
+//
+//   token          high 4 bits: literal count, low 4 bits: match length - LZ_MINMATCH
+//   [count bytes]  when a field of the token is 15, bytes of 255 follow
+//                  until one below 255, all added to it
+//   literals       copied to the output as they are
+//   offset         2 bytes, little endian: how far back the match starts
+//   [length bytes] as for the literal count
+//
+// The final sequence has literals only and ends the data. Matches are
+// found through a hash table of the positions of 4 byte strings and
+// may overlap the bytes they produce, which repeats short runs.
+
+#define LZ_HASHBITS 14          // log2 of the number of hash table entries
+#define LZ_MINMATCH 4           // shortest match encoded
+#define LZ_MAXOFF 65535         // furthest back a match may start
+
+static unsigned int lz_hash(const char *p) {
+  unsigned int v;
+  memcpy(&v, p, sizeof(v));
+  return (v * 2654435761u) >> (32 - LZ_HASHBITS);
+}
+
+static int lz_put_count(char *dst, int out, int count) {
+// Write the bytes continuing a count of at least 15 which did not fit
+// its token field. Returns the new output length.
+  count -= 15;
+  while (count >= 255) {
+    dst[out++] = (char) 255;
+    count -= 255;
+  }
+  dst[out++] = count;
+  return out;
+}
+
+static int lz_put_sequence(char *dst, int out, const char *lit, int n_lit, int off, int match) {
+// Append a sequence of n_lit literals and a match of the given length
+// off bytes back, or just the literals if match is 0.
+  int mfield = match ? match - LZ_MINMATCH : 0;
+  dst[out++] = (n_lit < 15 ? n_lit : 15) << 4 | (mfield < 15 ? mfield : 15);
+  if (n_lit >= 15)
+    out = lz_put_count(dst, out, n_lit);
+  memcpy(dst + out, lit, n_lit);
+  out += n_lit;
+  if (match == 0)
+    return out;
+  dst[out++] = off & 0xff;
+  dst[out++] = off >> 8;
+  if (mfield >= 15)
+    out = lz_put_count(dst, out, mfield);
+  return out;
+}
+
+// Compress the len bytes at src into dst, which must have room for
+// LZ_BOUND(len) bytes. Returns the compressed length.
+int lz_compress(const char *src, int len, char *dst) {
+  int *table = malloc(sizeof(int) << LZ_HASHBITS);
+  check_fail(table == NULL, 1, "couldn't allocate compression table\n");
+  memset(table, -1, sizeof(int) << LZ_HASHBITS);
+  int out = 0, anchor = 0, i = 0;
+  while (i + LZ_MINMATCH <= len) {
+    unsigned int h = lz_hash(src + i);
+    int cand = table[h];
+    table[h] = i;
+    if (cand < 0 || i - cand > LZ_MAXOFF || memcmp(src + cand, src + i, LZ_MINMATCH) != 0) {
+      i++;
+      continue;
+    }
+    int match = LZ_MINMATCH;
+    while (i + match < len && src[cand + match] == src[i + match])
+      match++;
+    out = lz_put_sequence(dst, out, src + anchor, i - anchor, i - cand, match);
+    i += match;
+    anchor = i;
+  }
+  out = lz_put_sequence(dst, out, src + anchor, len - anchor, 0, 0);
+  free(table);
+  return out;
+}
+
+static int lz_get_count(const char *src, int len, int *in, int count) {
+// Add the bytes continuing a count whose token field was 15. Returns
+// the count or -1 if the data ends first.
+  unsigned char b;
+  do {
+    if (*in >= len)
+      return -1;
+    b = src[(*in)++];
+    count += b;
+  } while (b == 255);
+  return count;
+}
+
+// Decompress the len bytes at src into dst, which has room for cap
+// bytes. Returns the decompressed length or -1 if the data is
+// malformed or would not fit.
+int lz_decompress(const char *src, int len, char *dst, int cap) {
+  int in = 0, out = 0;
+  while (in < len) {
+    unsigned char token = src[in++];
+    int n_lit = token >> 4;
+    if (n_lit == 15 && (n_lit = lz_get_count(src, len, &in, n_lit)) < 0)
+      return -1;
+    if (n_lit > len - in || n_lit > cap - out)
+      return -1;
+    memcpy(dst + out, src + in, n_lit);
+    in += n_lit;
+    out += n_lit;
+    if (in == len)
+      return out;               // the final sequence has no match
+    if (len - in < 2)
+      return -1;
+    int off = (unsigned char) src[in] | (unsigned char) src[in+1] << 8;
+    in += 2;
+    int match = token & 15;
+    if (match == 15 && (match = lz_get_count(src, len, &in, match)) < 0)
+      return -1;
+    match += LZ_MINMATCH;
+    if (off == 0 || off > out || match > cap - out)
+      return -1;
+    for (int k = 0; k < match; k++, out++)
+      dst[out] = dst[out - off]; // byte at a time since a match may overlap its output
+  }
+  return out;
+}
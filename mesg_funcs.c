@@ -0,0 +1,203 @@
+#include "blather.h"
+
+// Returns 1 for kinds which introduce a session id and so carry the
+// name of their subject as the body on the wire.
+static int mesg_names_id(int kind) {
+  return kind == BL_JOINED || kind == BL_NAMEMAP;
+}
+
+// Read exactly len bytes from fd unless end of input or an error is
+// reached first. Returns the number of bytes read.
+static int read_full(int fd, void *buf, int len) {
+  int off = 0;
+  while (off < len) {
+    int bytes = read(fd, (char *) buf + off, len - off);
+    if (bytes <= 0)
+      break;
+    off += bytes;
+  }
+  return off;
+}
+
+static unsigned int crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+// Fill crc_table for the reflected CRC-32 polynomial. crc_table[0] is
+// the usual byte at a time table; crc_table[k] advances a byte's CRC
+// past k more zero bytes so that 8 bytes can be folded in at once.
+static void crc_init() {
+  for (unsigned int i = 0; i < 256; i++) {
+    unsigned int c = i;
+    for (int k = 0; k < 8; k++)
+      c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    crc_table[0][i] = c;
+  }
+  for (int k = 1; k < 8; k++) {
+    for (unsigned int i = 0; i < 256; i++) {
+      unsigned int c = crc_table[k-1][i];
+      crc_table[k][i] = crc_table[0][c & 0xff] ^ (c >> 8);
+    }
+  }
+}
+
+// Fold len bytes at buf into crc, 8 bytes per step ("slicing by 8"),
+// which makes checking records on a large log several times faster
+// than a byte at a time.
+static unsigned int crc_update(unsigned int crc, char *buf, int len) {
+  unsigned char *p = (unsigned char *) buf;
+  for (; len >= 8; len -= 8, p += 8) {
+    unsigned int lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24);
+    unsigned int hi = p[4] | p[5] << 8 | p[6] << 16 | (unsigned int) p[7] << 24;
+    crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+          crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+          crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+          crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+  }
+  for (; len > 0; len--, p++)
+    crc = crc_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+// Compute the checksum of the encoded message of len bytes at wire,
+// treating its crc field as 0.
+unsigned int mesg_crc(char *wire, int len) {
+  pthread_once(&crc_once, crc_init);
+  wire_t hdr;
+  memcpy(&hdr, wire, sizeof(wire_t));
+  hdr.crc = 0;
+  unsigned int crc = crc_update(0xffffffff, (char *) &hdr, sizeof(wire_t));
+  crc = crc_update(crc, wire + sizeof(wire_t), len - sizeof(wire_t));
+  return crc ^ 0xffffffff;
+}
+
+// Returns the number of bytes mesg_encode() fills for mesg.
+int mesg_wire_len(mesg_t *mesg) {
+  if (mesg->kind == BL_FOUND) {
+    int name_len = strnlen(mesg->name, MAXNAME - 1);
+    return sizeof(wire_t) + name_len + 1 + strnlen(mesg->body, MAXLINE - 2 - name_len);
+  }
+  if (mesg_names_id(mesg->kind))
+    return sizeof(wire_t) + strnlen(mesg->name, MAXNAME - 1);
+  return sizeof(wire_t) + strnlen(mesg->body, MAXLINE - 1);
+}
+
+// Encode mesg into buf as a wire_t header followed by the body
+// bytes. Returns the number of bytes of buf which were filled.
+int mesg_encode(mesg_t *mesg, char buf[MAXWIRE]) {
+  wire_t *wire = (wire_t *) buf;
+  memset(wire, 0, sizeof(wire_t));  // no uninitialized padding goes out
+  char *body = mesg_names_id(mesg->kind) ? mesg->name : mesg->body;
+  int max = mesg_names_id(mesg->kind) ? MAXNAME : MAXLINE;
+  wire->seq = mesg->seq;
+  wire->tstamp = mesg->tstamp;
+  wire->kind = mesg->kind;
+  wire->name_id = mesg->name_id;
+  if (mesg->kind == BL_FOUND) {     // name and body, the body cut short to fit
+    int name_len = strnlen(mesg->name, MAXNAME - 1);
+    int text_len = strnlen(mesg->body, MAXLINE - 2 - name_len);
+    memcpy(buf + sizeof(wire_t), mesg->name, name_len);
+    buf[sizeof(wire_t) + name_len] = '\0';
+    memcpy(buf + sizeof(wire_t) + name_len + 1, mesg->body, text_len);
+    wire->body_len = name_len + 1 + text_len;
+    wire->crc = mesg_crc(buf, sizeof(wire_t) + wire->body_len);
+    return sizeof(wire_t) + wire->body_len;
+  }
+  wire->body_len = strnlen(body, max - 1);
+  memcpy(buf + sizeof(wire_t), body, wire->body_len);
+  wire->crc = mesg_crc(buf, sizeof(wire_t) + wire->body_len);
+  return sizeof(wire_t) + wire->body_len;
+}
+
+// Decode a single message from the len bytes at buf. The name of the
+// message is only filled in for kinds which carry it; use
+// nametab_resolve() for the rest. Returns the number of bytes
+// consumed, 0 if buf does not yet hold a whole message and -1 if the
+// bytes are not a valid message or fail their checksum.
+int mesg_decode(char *buf, int len, mesg_t *mesg) {
+  if (len < sizeof(wire_t))
+    return 0;
+  wire_t wire;
+  memcpy(&wire, buf, sizeof(wire_t));
+  int max = mesg_names_id(wire.kind) ? MAXNAME : MAXLINE;
+  if (wire.body_len < 0 || wire.body_len >= max)
+    return -1;
+  if (len < sizeof(wire_t) + wire.body_len)
+    return 0;
+  if (mesg_crc(buf, sizeof(wire_t) + wire.body_len) != wire.crc)
+    return -1;
+  mesg->seq = wire.seq;
+  mesg->tstamp = wire.tstamp;
+  mesg->kind = wire.kind;
+  mesg->name_id = wire.name_id;
+  char *body = mesg_names_id(wire.kind) ? mesg->name : mesg->body;
+  memcpy(body, buf + sizeof(wire_t), wire.body_len);
+  body[wire.body_len] = '\0';
+  if (wire.kind == BL_FOUND) {      // split into name and body
+    int name_len = strnlen(body, wire.body_len);
+    if (name_len == wire.body_len || name_len >= MAXNAME)
+      return -1;
+    memcpy(mesg->name, body, name_len + 1);
+    memmove(body, body + name_len + 1, wire.body_len - name_len);
+  } else if (mesg_names_id(wire.kind))
+    mesg->body[0] = '\0';
+  else
+    mesg->name[0] = '\0';
+  return sizeof(wire_t) + wire.body_len;
+}
+
+// Encode and send mesg to fd with a single write() so that it is not
+// interleaved with messages from other writers. Returns 0 on success
+// and -1 on failure.
+int mesg_write(int fd, mesg_t *mesg) {
+  char buf[MAXWIRE];
+  int len = mesg_encode(mesg, buf);
+  int bytes = write(fd, buf, len);
+  return bytes == len ? 0 : -1;
+}
+
+// Read one message from fd into mesg. Returns 1 if a message was
+// read, 0 at end of input and -1 on a short read or malformed
+// message.
+int mesg_read(int fd, mesg_t *mesg) {
+  char buf[MAXWIRE];
+  int bytes = read_full(fd, buf, sizeof(wire_t));
+  if (bytes == 0)
+    return 0;
+  if (bytes != sizeof(wire_t))
+    return -1;
+  int body_len = ((wire_t *) buf)->body_len;
+  if (body_len < 0 || body_len >= MAXLINE)
+    return -1;
+  if (read_full(fd, buf + sizeof(wire_t), body_len) != body_len)
+    return -1;
+  return mesg_decode(buf, sizeof(wire_t) + body_len, mesg) > 0 ? 1 : -1;
+}
+
+// Clear all entries of the name table.
+void nametab_init(nametab_t *tab) {
+  for (int i = 0; i < MAXCLIENTS; i++)
+    tab->names[i][0] = '\0';
+}
+
+// Record the name carried by BL_JOINED/BL_NAMEMAP messages and fill in
+// the name of all other messages from the table. Returns 0 if the
+// message's name is known after the call and -1 if its id has not
+// been announced yet.
+int nametab_resolve(nametab_t *tab, mesg_t *mesg) {
+  if (mesg->kind == BL_FOUND)
+    return 0;                   // names its sender itself
+  if (mesg->name_id == NOID) {
+    mesg->name[0] = '\0';
+    return 0;
+  }
+  if (mesg->name_id < 0 || mesg->name_id >= MAXCLIENTS) {
+    mesg->name[0] = '\0';
+    return -1;
+  }
+  if (mesg_names_id(mesg->kind) && mesg->name[0] != '\0') {
+    snprintf(tab->names[mesg->name_id], MAXNAME, "%s", mesg->name);
+    return 0;
+  }
+  snprintf(mesg->name, MAXNAME, "%s", tab->names[mesg->name_id]);
+  return mesg->name[0] == '\0' ? -1 : 0;
+}
@@ -0,0 +1,129 @@
+#include "blather.h"
+
+// Pool of buffers for encoded messages. A broadcast is encoded once
+// into a buffer from the pool and that one buffer is written to every
+// client, kept in the window for catching up, logged and relayed to
+// federated servers, each holding a reference with pool_ref() and
+// dropping it with pool_put(). The last pool_put() returns the buffer
+// to the pool rather than to the heap, so once the pool has grown to
+// the number of messages in use at once, sending a message allocates
+// nothing.
+//
+// Buffers come in a few fixed size classes, the smallest which holds
+// the message being used. Each thread keeps free lists of its own
+// which it uses without locking; only when a list runs empty or grows
+// long are POOL_BATCH buffers moved from or to the free lists shared
+// by all threads under pool_lock. A buffer may be put by a different
+// thread than the one which got it.
+
+#define POOL_CLASSES 3          // number of size classes
+
+static const int pool_sizes[POOL_CLASSES] = { 128, 512, MAXWIRE };
+
+static __thread msgbuf_t *local_free[POOL_CLASSES]; // this thread's free buffers by class
+static __thread int local_count[POOL_CLASSES];
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static msgbuf_t *shared_free[POOL_CLASSES]; // free buffers any thread may take, under pool_lock
+static int shared_count[POOL_CLASSES];
+
+static poolstats_t stats;       // updated atomically as threads share them
+
+static void pool_take_shared(int cls) {
+// Move up to POOL_BATCH buffers of class cls from the shared free list
+// to this thread's.
+  pthread_mutex_lock(&pool_lock);
+  for (int k = 0; k < POOL_BATCH && shared_free[cls] != NULL; k++) {
+    msgbuf_t *buf = shared_free[cls];
+    shared_free[cls] = buf->next;
+    shared_count[cls]--;
+    buf->next = local_free[cls];
+    local_free[cls] = buf;
+    local_count[cls]++;
+  }
+  pthread_mutex_unlock(&pool_lock);
+}
+
+static void pool_give_shared(int cls) {
+// Move POOL_BATCH buffers of class cls from this thread's free list to
+// the shared one.
+  pthread_mutex_lock(&pool_lock);
+  for (int k = 0; k < POOL_BATCH && local_free[cls] != NULL; k++) {
+    msgbuf_t *buf = local_free[cls];
+    local_free[cls] = buf->next;
+    local_count[cls]--;
+    buf->next = shared_free[cls];
+    shared_free[cls] = buf;
+    shared_count[cls]++;
+  }
+  pthread_mutex_unlock(&pool_lock);
+}
+
+// Get a buffer with room for len bytes, at most MAXWIRE, holding one
+// reference and no data.
+msgbuf_t *pool_get(int len) {
+  int cls = 0;
+  while (cls < POOL_CLASSES - 1 && pool_sizes[cls] < len)
+    cls++;
+  check_fail(len > pool_sizes[cls], 0, "message of %d bytes is too large for the pool\n", len);
+  if (local_free[cls] == NULL)
+    pool_take_shared(cls);
+  long gets = __atomic_add_fetch(&stats.gets, 1, __ATOMIC_RELAXED);
+  msgbuf_t *buf = local_free[cls];
+  if (buf != NULL) {
+    local_free[cls] = buf->next;
+    local_count[cls]--;
+  } else {
+    buf = malloc(sizeof(msgbuf_t) + pool_sizes[cls]);
+    check_fail(buf == NULL, 1, "couldn't allocate a message buffer\n");
+    buf->size_class = cls;
+    buf->cap = pool_sizes[cls];
+    __atomic_add_fetch(&stats.heap, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.last_heap, gets, __ATOMIC_RELAXED);
+  }
+  buf->next = NULL;
+  buf->refs = 1;
+  buf->len = 0;
+  long live = __atomic_add_fetch(&stats.live, 1, __ATOMIC_RELAXED);
+  long peak = __atomic_load_n(&stats.peak, __ATOMIC_RELAXED);
+  while (live > peak && !__atomic_compare_exchange_n(&stats.peak, &peak, live, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+  return buf;
+}
+
+// Take another reference to buf. Returns buf.
+msgbuf_t *pool_ref(msgbuf_t *buf) {
+  __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+  return buf;
+}
+
+// Drop a reference to buf, returning it to this thread's free list
+// once no references are left.
+void pool_put(msgbuf_t *buf) {
+  if (__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  int cls = buf->size_class;
+  buf->next = local_free[cls];
+  local_free[cls] = buf;
+  local_count[cls]++;
+  __atomic_sub_fetch(&stats.live, 1, __ATOMIC_RELAXED);
+  if (local_count[cls] > 2 * POOL_BATCH)
+    pool_give_shared(cls);      // another thread may be the one getting buffers
+}
+
+// Encode mesg into a buffer from the pool just large enough for it.
+// Returns the buffer, holding one reference.
+msgbuf_t *pool_encode(mesg_t *mesg) {
+  msgbuf_t *buf = pool_get(mesg_wire_len(mesg));
+  buf->len = mesg_encode(mesg, buf->data);
+  return buf;
+}
+
+// Copy the pool's counts into out.
+void pool_stats(poolstats_t *out) {
+  out->gets = __atomic_load_n(&stats.gets, __ATOMIC_RELAXED);
+  out->heap = __atomic_load_n(&stats.heap, __ATOMIC_RELAXED);
+  out->last_heap = __atomic_load_n(&stats.last_heap, __ATOMIC_RELAXED);
+  out->live = __atomic_load_n(&stats.live, __ATOMIC_RELAXED);
+  out->peak = __atomic_load_n(&stats.peak, __ATOMIC_RELAXED);
+}
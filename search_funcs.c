@@ -0,0 +1,639 @@
+#include "blather.h"
+
+// Full-text search of the chat history for "%search <terms>"
+// (ADVANCED, selected by BL_SEARCH). The server keeps an inverted
+// index from each word of a logged chat message to the messages which
+// contain it and answers a search with the most recent messages
+// holding every term.
+//
+// Messages are numbered in the order they are logged ("docs"). For
+// each doc the index keeps its sequence number, the log offset from
+// which reading finds it, which is the record itself or the
+// BL_LOGBLOCK holding it, and its sender. Each word keeps a posting
+// list of the docs containing it in increasing order. Words are runs
+// of letters, digits and non-ASCII bytes, folded to lower case and cut
+// to SEARCH_TOKEN-1 bytes.
+//
+// Updates are kept off the server's path: server_log_message() only
+// queues each chat message with search_add() and an indexing thread
+// tokenizes the queue and adds it to the index. When the index opens,
+// the same thread first indexes whatever the log holds beyond the
+// saved index, all of it if there is none, so the index never misses a
+// logged message.
+//
+// Persistence: at each checkpoint and at shutdown the thread saves the
+// index as "server_name.idx", a searchhdr_t followed by the senders'
+// names, the docs and the posting lists, with numbers as varints and
+// docs and postings delta encoded.
+
+#define SEARCH_MAGIC 0x424c5349 // identifies a saved index, "BLSI"
+#define SEARCH_MAXTERMS 16      // most terms used from one query
+#define SEARCH_BATCH 4096       // docs indexed from the log per hold of the index lock
+
+// searchhdr_t: start of a saved index
+typedef struct {
+  int magic;                    // SEARCH_MAGIC
+  int n_names;                  // number of sender names following
+  long n_docs;                  // number of docs following the names
+  long n_terms;                 // number of posting lists following the docs
+  long log_off;                 // log offset up to which messages were indexed
+} searchhdr_t;
+
+// term_t: a word and the docs containing it
+typedef struct {
+  char word[SEARCH_TOKEN];      // the word, empty for an unused slot of the table
+  int *post;                    // docs containing it in increasing order
+  int n_post;
+  int max_post;
+} term_t;
+
+// search_t: the index of one server
+struct search {
+  char server_name[MAXPATH];
+  pthread_t thread;             // indexer
+  pthread_mutex_t queue_lock;   // guards the queue and the flags below
+  pthread_cond_t wake;          // signals the indexer that there is work
+  char *queue;                  // queued messages, see search_add()
+  int queue_len;
+  int queue_max;
+  int save;                     // flag: the index should be saved
+  int stop;                     // flag: the indexer should finish the queue and exit
+  long scan_from;               // log offset the indexer starts reading from
+  long scan_upto;               // last seq logged before the index opened
+
+  pthread_mutex_t index_lock;   // guards everything below
+  long n_docs;
+  long max_docs;
+  long *doc_seq;                // sequence number of each doc
+  long *doc_off;                // log offset at which to start reading for it
+  int *doc_name;                // sender of each doc, a name number
+  int n_names;
+  int max_names;                // size of names and name_table, a power of 2
+  char (*names)[MAXNAME];       // sender names by number
+  int *name_table;              // hash table of name numbers, -1 where unused
+  long n_terms;
+  long max_terms;               // size of terms, a power of 2
+  term_t *terms;                // hash table of words
+  long n_postings;              // total length of the posting lists
+  long log_off;                 // log offset of the last doc indexed
+  long index_usec;              // time spent indexing
+  long saved_bytes;             // size of the index last saved
+};
+
+// queued_t: header of a message queued for the indexer, followed by
+// its sender's name and its body
+typedef struct {
+  long seq;
+  long off;
+  int name_len;
+  int body_len;
+} queued_t;
+
+static unsigned int search_hash(const char *s) {
+// FNV-1a hash of the string s.
+  unsigned int h = 2166136261u;
+  for (; *s != '\0'; s++)
+    h = (h ^ (unsigned char) *s) * 16777619u;
+  return h;
+}
+
+static int search_tokens(const char *text, char words[][SEARCH_TOKEN], int max) {
+// Split text into at most max words as the index keeps them. Returns
+// the number of words.
+  int n = 0;
+  while (*text != '\0' && n < max) {
+    unsigned char c = *text;
+    if (!(c >= 0x80 || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))) {
+      text++;
+      continue;
+    }
+    int len = 0;
+    for (; (c = *text) != '\0' && (c >= 0x80 || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')); text++) {
+      if (len < SEARCH_TOKEN - 1)
+        words[n][len++] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+    }
+    words[n++][len] = '\0';
+  }
+  return n;
+}
+
+static term_t *search_term(search_t *s, const char *word, int create) {
+// Find the posting list of word, adding an empty one if create is set.
+// Returns NULL if the word is not indexed and create is not set.
+  if (create && 2 * (s->n_terms + 1) > s->max_terms) {
+    term_t *old = s->terms;
+    long old_max = s->max_terms;
+    s->max_terms = old_max ? old_max * 2 : 4096;
+    s->terms = calloc(s->max_terms, sizeof(term_t));
+    check_fail(s->terms == NULL, 1, "couldn't grow the search index\n");
+    for (long i = 0; i < old_max; i++) {
+      if (old[i].word[0] == '\0')
+        continue;
+      long j = search_hash(old[i].word) & (s->max_terms - 1);
+      while (s->terms[j].word[0] != '\0')
+        j = (j + 1) & (s->max_terms - 1);
+      s->terms[j] = old[i];
+    }
+    free(old);
+  }
+  if (s->max_terms == 0)
+    return NULL;
+  long j = search_hash(word) & (s->max_terms - 1);
+  while (s->terms[j].word[0] != '\0') {
+    if (strcmp(s->terms[j].word, word) == 0)
+      return &s->terms[j];
+    j = (j + 1) & (s->max_terms - 1);
+  }
+  if (!create)
+    return NULL;
+  snprintf(s->terms[j].word, SEARCH_TOKEN, "%s", word);
+  s->n_terms++;
+  return &s->terms[j];
+}
+
+static void search_post(search_t *s, term_t *t, int doc) {
+// Add doc to the posting list of t unless it is there already.
+  if (t->n_post > 0 && t->post[t->n_post-1] == doc)
+    return;
+  if (t->n_post == t->max_post) {
+    t->max_post = t->max_post ? t->max_post * 2 : 4;
+    t->post = realloc(t->post, sizeof(int) * t->max_post);
+    check_fail(t->post == NULL, 1, "couldn't grow the search index\n");
+  }
+  t->post[t->n_post++] = doc;
+  s->n_postings++;
+}
+
+static int search_name(search_t *s, const char *name) {
+// Returns the number of the sender name, adding it if it is new.
+  if (2 * (s->n_names + 1) > s->max_names) {
+    s->max_names = s->max_names ? s->max_names * 2 : 64;
+    s->names = realloc(s->names, sizeof(s->names[0]) * s->max_names);
+    s->name_table = realloc(s->name_table, sizeof(int) * s->max_names);
+    check_fail(s->names == NULL || s->name_table == NULL, 1, "couldn't grow the search index\n");
+    for (int i = 0; i < s->max_names; i++)
+      s->name_table[i] = -1;
+    for (int k = 0; k < s->n_names; k++) {
+      int j = search_hash(s->names[k]) & (s->max_names - 1);
+      while (s->name_table[j] != -1)
+        j = (j + 1) & (s->max_names - 1);
+      s->name_table[j] = k;
+    }
+  }
+  int j = search_hash(name) & (s->max_names - 1);
+  while (s->name_table[j] != -1) {
+    if (strcmp(s->names[s->name_table[j]], name) == 0)
+      return s->name_table[j];
+    j = (j + 1) & (s->max_names - 1);
+  }
+  snprintf(s->names[s->n_names], MAXNAME, "%s", name);
+  s->name_table[j] = s->n_names;
+  return s->n_names++;
+}
+
+static int search_doc(search_t *s, long seq, long off, int name) {
+// Add a doc for the message numbered seq from sender number name.
+// Returns the doc's number.
+  if (s->n_docs == s->max_docs) {
+    s->max_docs = s->max_docs ? s->max_docs * 2 : 4096;
+    s->doc_seq = realloc(s->doc_seq, sizeof(long) * s->max_docs);
+    s->doc_off = realloc(s->doc_off, sizeof(long) * s->max_docs);
+    s->doc_name = realloc(s->doc_name, sizeof(int) * s->max_docs);
+    check_fail(s->doc_seq == NULL || s->doc_off == NULL || s->doc_name == NULL, 1, "couldn't grow the search index\n");
+  }
+  int doc = s->n_docs++;
+  s->doc_seq[doc] = seq;
+  s->doc_off[doc] = off;
+  s->doc_name[doc] = name;
+  s->log_off = off;
+  return doc;
+}
+
+static void search_index(search_t *s, long seq, long off, const char *name, const char *body) {
+// Add a chat message to the index. The caller holds index_lock.
+  int doc = search_doc(s, seq, off, search_name(s, name));
+  char words[MAXLINE/2][SEARCH_TOKEN];
+  int n = search_tokens(body, words, MAXLINE/2);
+  for (int i = 0; i < n; i++)
+    search_post(s, search_term(s, words[i], 1), doc);
+}
+
+static int put_varint(char *buf, unsigned long v) {
+// Write v 7 bits per byte, low bits first. Returns the bytes written.
+  int n = 0;
+  while (v >= 0x80) {
+    buf[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  buf[n++] = v;
+  return n;
+}
+
+static int get_varint(char *buf, long len, long *pos, unsigned long *v) {
+// Read a varint at buf[*pos]. Returns 0 on success and -1 if buf ends
+// before it does.
+  *v = 0;
+  for (int shift = 0; *pos < len && shift < 64; shift += 7) {
+    unsigned char b = buf[(*pos)++];
+    *v |= (unsigned long) (b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return 0;
+  }
+  return -1;
+}
+
+static char *search_encode(search_t *s, long *len) {
+// Encode the index as it is saved. The caller holds index_lock.
+// Returns a buffer the caller must free() and sets *len.
+  long max = sizeof(searchhdr_t) + (long) s->n_names * (MAXNAME + 1)
+    + s->n_docs * 30 + s->n_terms * (SEARCH_TOKEN + 10) + s->n_postings * 5;
+  char *buf = malloc(max);
+  check_fail(buf == NULL, 1, "couldn't allocate the search index\n");
+  searchhdr_t hdr = {
+    .magic = SEARCH_MAGIC,
+    .n_names = s->n_names,
+    .n_docs = s->n_docs,
+    .n_terms = s->n_terms,
+    .log_off = s->log_off,
+  };
+  memcpy(buf, &hdr, sizeof(hdr));
+  long pos = sizeof(hdr);
+  for (int k = 0; k < s->n_names; k++) {
+    int n = strlen(s->names[k]);
+    buf[pos++] = n;
+    memcpy(buf + pos, s->names[k], n);
+    pos += n;
+  }
+  long seq = 0, off = 0;
+  for (long d = 0; d < s->n_docs; d++) {
+    pos += put_varint(buf + pos, s->doc_seq[d] - seq);
+    pos += put_varint(buf + pos, s->doc_off[d] - off);
+    pos += put_varint(buf + pos, s->doc_name[d]);
+    seq = s->doc_seq[d];
+    off = s->doc_off[d];
+  }
+  for (long i = 0; i < s->max_terms; i++) {
+    term_t *t = &s->terms[i];
+    if (t->word[0] == '\0')
+      continue;
+    int n = strlen(t->word);
+    buf[pos++] = n;
+    memcpy(buf + pos, t->word, n);
+    pos += n;
+    pos += put_varint(buf + pos, t->n_post);
+    int prev = -1;
+    for (int k = 0; k < t->n_post; k++) {
+      pos += put_varint(buf + pos, t->post[k] - prev);
+      prev = t->post[k];
+    }
+  }
+  *len = pos;
+  return buf;
+}
+
+static int search_decode(search_t *s, char *buf, long len) {
+// Load a saved index into the empty index s. Returns 0 on success and
+// -1 if buf is not a whole saved index.
+  searchhdr_t hdr;
+  if (len < sizeof(hdr))
+    return -1;
+  memcpy(&hdr, buf, sizeof(hdr));
+  if (hdr.magic != SEARCH_MAGIC || hdr.n_names < 0 || hdr.n_docs < 0 || hdr.n_docs > INT_MAX || hdr.n_terms < 0)
+    return -1;
+  long pos = sizeof(hdr);
+  unsigned long v;
+  for (int k = 0; k < hdr.n_names; k++) {
+    if (pos >= len || pos + 1 + (unsigned char) buf[pos] > len)
+      return -1;
+    char name[MAXNAME];
+    int n = (unsigned char) buf[pos++];
+    memcpy(name, buf + pos, n);
+    name[n] = '\0';
+    pos += n;
+    if (search_name(s, name) != k)
+      return -1;
+  }
+  long seq = 0, off = 0;
+  for (long d = 0; d < hdr.n_docs; d++) {
+    if (get_varint(buf, len, &pos, &v) != 0)
+      return -1;
+    seq += v;
+    if (get_varint(buf, len, &pos, &v) != 0)
+      return -1;
+    off += v;
+    if (get_varint(buf, len, &pos, &v) != 0 || v >= hdr.n_names)
+      return -1;
+    search_doc(s, seq, off, v);
+  }
+  for (long i = 0; i < hdr.n_terms; i++) {
+    if (pos >= len || pos + 1 + (unsigned char) buf[pos] > len || (unsigned char) buf[pos] >= SEARCH_TOKEN)
+      return -1;
+    char word[SEARCH_TOKEN];
+    int n = (unsigned char) buf[pos++];
+    memcpy(word, buf + pos, n);
+    word[n] = '\0';
+    pos += n;
+    term_t *t = search_term(s, word, 1);
+    if (get_varint(buf, len, &pos, &v) != 0 || v > hdr.n_docs)
+      return -1;
+    long n_post = v, doc = -1;
+    for (long k = 0; k < n_post; k++) {
+      if (get_varint(buf, len, &pos, &v) != 0 || v == 0 || doc + v >= hdr.n_docs)
+        return -1;
+      doc += v;
+      search_post(s, t, doc);
+    }
+  }
+  s->log_off = hdr.log_off;
+  return pos == len ? 0 : -1;
+}
+
+static void search_reset(search_t *s) {
+// Empty the index.
+  for (long i = 0; i < s->max_terms; i++)
+    free(s->terms[i].post);
+  free(s->terms);
+  free(s->doc_seq);
+  free(s->doc_off);
+  free(s->doc_name);
+  free(s->names);
+  free(s->name_table);
+  s->terms = NULL;
+  s->doc_seq = s->doc_off = NULL;
+  s->doc_name = s->name_table = NULL;
+  s->names = NULL;
+  s->n_terms = s->max_terms = s->n_postings = 0;
+  s->n_docs = s->max_docs = 0;
+  s->n_names = s->max_names = 0;
+  s->log_off = 0;
+}
+
+static void search_load(search_t *s) {
+// Load "server_name.idx" if there is one which is intact, else leave
+// the index empty.
+  char idxname[MAXPATH+4];
+  snprintf(idxname, MAXPATH+4, "%s.idx", s->server_name);
+  int fd = open(idxname, O_RDONLY);
+  if (fd == -1)
+    return;
+  struct stat st;
+  char *buf = NULL;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    buf = malloc(st.st_size);
+  if (buf != NULL && read(fd, buf, st.st_size) == st.st_size && search_decode(s, buf, st.st_size) == 0)
+    s->saved_bytes = st.st_size;
+  else
+    search_reset(s);
+  free(buf);
+  close(fd);
+}
+
+static void search_save(search_t *s) {
+// Atomically replace "server_name.idx" with the index, encoded while
+// holding index_lock and written without it.
+  pthread_mutex_lock(&s->index_lock);
+  long len;
+  char *buf = search_encode(s, &len);
+  pthread_mutex_unlock(&s->index_lock);
+  char idxname[MAXPATH+4];
+  char tmpname[MAXPATH+8];
+  snprintf(idxname, MAXPATH+4, "%s.idx", s->server_name);
+  snprintf(tmpname, MAXPATH+8, "%s.idx.tmp", s->server_name);
+  int fd = open(tmpname, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+  check_fail(fd == -1, 1, "couldn't open search index %s\n", tmpname);
+  check_fail(write(fd, buf, len) != len, 1, "couldn't write search index\n");
+  close(fd);
+  check_fail(rename(tmpname, idxname) == -1, 1, "couldn't replace search index %s\n", idxname);
+  free(buf);
+  s->saved_bytes = len;
+}
+
+static void search_catch_up(search_t *s) {
+// Index the chat messages logged before the index opened which it
+// does not hold yet, reading the log from scan_from.
+  char logname[MAXPATH+4];
+  snprintf(logname, MAXPATH+4, "%s.log", s->server_name);
+  int fd = open(logname, O_RDONLY);
+  check_fail(fd == -1, 1, "couldn't open logfile %s\n", logname);
+  nametab_t *names = malloc(sizeof(nametab_t));
+  check_fail(names == NULL, 1, "couldn't allocate a name table\n");
+  nametab_init(names);
+  logscan_t scan;
+  logscan_open(&scan, fd, s->scan_from);
+  mesg_t msg;
+  long last = s->n_docs ? s->doc_seq[s->n_docs-1] : 0;
+  int ret = 1;
+  while (ret == 1) {
+    long start = clock_usec();
+    pthread_mutex_lock(&s->index_lock);
+    for (int k = 0; k < SEARCH_BATCH && (ret = logscan_next(&scan, &msg)) == 1; ) {
+      nametab_resolve(names, &msg);
+      if (msg.seq > s->scan_upto) {
+        ret = 0;                // queued by search_add() instead
+        break;
+      }
+      if (msg.kind == BL_MESG && msg.seq > last) {
+        search_index(s, msg.seq, scan.rec_off, msg.name, msg.body);
+        k++;
+      }
+    }
+    s->index_usec += clock_usec() - start;
+    pthread_mutex_unlock(&s->index_lock);
+  }
+  logscan_close(&scan);
+  free(names);
+  close(fd);
+}
+
+static void *search_thread(void *arg) {
+// Body of the indexing thread: catch up with the log, then index
+// whatever search_add() queues and save when asked until stopped.
+  search_t *s = arg;
+  long start = clock_usec();
+  search_catch_up(s);
+  log_printf("search index holds %ld messages after catching up in %ld usec\n", s->n_docs, clock_usec() - start);
+  char *batch = NULL;
+  int batch_max = 0;
+  while (1) {
+    pthread_mutex_lock(&s->queue_lock);
+    while (s->queue_len == 0 && !s->save && !s->stop)
+      pthread_cond_wait(&s->wake, &s->queue_lock);
+    char *tmp = batch;          // take the queue, leaving the other buffer for search_add()
+    int tmp_max = batch_max;
+    batch = s->queue;
+    batch_max = s->queue_max;
+    int len = s->queue_len;
+    s->queue = tmp;
+    s->queue_max = tmp_max;
+    s->queue_len = 0;
+    int save = s->save, stop = s->stop;
+    s->save = 0;
+    pthread_mutex_unlock(&s->queue_lock);
+
+    start = clock_usec();
+    pthread_mutex_lock(&s->index_lock);
+    for (int pos = 0; pos < len; ) {
+      queued_t q;
+      memcpy(&q, batch + pos, sizeof(q));
+      char *name = batch + pos + sizeof(q);
+      char *body = name + q.name_len + 1;
+      search_index(s, q.seq, q.off, name, body);
+      pos += sizeof(q) + q.name_len + 1 + q.body_len + 1;
+    }
+    s->index_usec += clock_usec() - start;
+    pthread_mutex_unlock(&s->index_lock);
+    if (save || stop)
+      search_save(s);
+    if (stop)
+      break;
+  }
+  free(batch);
+  return NULL;
+}
+
+search_t *search_open(server_t *server) {
+// Open the search index of the server if BL_SEARCH asks for one and
+// start the indexing thread. Returns NULL if BL_SEARCH is not set.
+// Must be called once the log has been recovered.
+  if (!DO_ADVANCED || getenv("BL_SEARCH") == NULL)
+    return NULL;
+  search_t *s = calloc(1, sizeof(search_t));
+  check_fail(s == NULL, 1, "couldn't allocate the search index\n");
+  snprintf(s->server_name, MAXPATH, "%s", server->server_name);
+  pthread_mutex_init(&s->queue_lock, NULL);
+  pthread_mutex_init(&s->index_lock, NULL);
+  pthread_cond_init(&s->wake, NULL);
+  search_load(s);
+  long last = s->n_docs ? s->doc_seq[s->n_docs-1] : 0;
+  if (last > server->seq || s->log_off > server->ckpt.valid_off) {
+    log_printf("search index is ahead of the log, rebuilding it\n");
+    search_reset(s);
+    last = 0;
+  }
+  s->scan_from = log_index_find(server->index, server->ckpt.n_index, last);
+  s->scan_upto = server->seq;
+  pthread_create(&s->thread, NULL, search_thread, s);
+  return s;
+}
+
+void search_add(search_t *s, mesg_t *mesg, long off) {
+// Queue a chat message for indexing. off is where reading the log
+// finds it: the offset of its record or of the BL_LOGBLOCK that will
+// hold it.
+  int name_len = strlen(mesg->name);
+  int body_len = strlen(mesg->body);
+  int len = sizeof(queued_t) + name_len + 1 + body_len + 1;
+  pthread_mutex_lock(&s->queue_lock);
+  if (s->queue_len + len > s->queue_max) {
+    s->queue_max = s->queue_max ? s->queue_max * 2 : 65536;
+    s->queue = realloc(s->queue, s->queue_max);
+    check_fail(s->queue == NULL, 1, "couldn't grow the search queue\n");
+  }
+  queued_t q = {
+    .seq = mesg->seq,
+    .off = off,
+    .name_len = name_len,
+    .body_len = body_len,
+  };
+  char *at = s->queue + s->queue_len;
+  memcpy(at, &q, sizeof(q));
+  memcpy(at + sizeof(q), mesg->name, name_len + 1);
+  memcpy(at + sizeof(q) + name_len + 1, mesg->body, body_len + 1);
+  s->queue_len += len;
+  pthread_cond_signal(&s->wake);
+  pthread_mutex_unlock(&s->queue_lock);
+}
+
+void search_save_later(search_t *s) {
+// Ask the indexing thread to save the index once it has indexed what
+// is queued.
+  pthread_mutex_lock(&s->queue_lock);
+  s->save = 1;
+  pthread_cond_signal(&s->wake);
+  pthread_mutex_unlock(&s->queue_lock);
+}
+
+int search_query(search_t *s, char *terms, searchhit_t *hits, int max, long *total) {
+// Find the chat messages containing every word of terms. Fills hits
+// with the most recent max of them, oldest first, sets *total to the
+// number there are and returns the number placed in hits. Messages
+// still queued for indexing are not found.
+  char words[SEARCH_MAXTERMS][SEARCH_TOKEN];
+  int n_words = search_tokens(terms, words, SEARCH_MAXTERMS);
+  *total = 0;
+  if (n_words == 0)
+    return 0;
+  pthread_mutex_lock(&s->index_lock);
+  term_t *t[SEARCH_MAXTERMS];
+  for (int i = 0; i < n_words; i++) {
+    t[i] = search_term(s, words[i], 0);
+    if (t[i] == NULL) {
+      pthread_mutex_unlock(&s->index_lock);
+      return 0;
+    }
+  }
+  for (int i = 1; i < n_words; i++) { // shortest list first
+    for (int j = i; j > 0 && t[j]->n_post < t[j-1]->n_post; j--) {
+      term_t *tmp = t[j];
+      t[j] = t[j-1];
+      t[j-1] = tmp;
+    }
+  }
+  int n = 0;
+  for (int k = t[0]->n_post - 1; k >= 0; k--) { // newest first
+    int doc = t[0]->post[k], all = 1;
+    for (int i = 1; i < n_words && all; i++) {
+      int lo = 0, hi = t[i]->n_post;
+      while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (t[i]->post[mid] < doc)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      all = lo < t[i]->n_post && t[i]->post[lo] == doc;
+    }
+    if (!all)
+      continue;
+    (*total)++;
+    if (n < max) {
+      hits[n].seq = s->doc_seq[doc];
+      hits[n].off = s->doc_off[doc];
+      snprintf(hits[n].name, MAXNAME, "%s", s->names[s->doc_name[doc]]);
+      n++;
+    }
+  }
+  pthread_mutex_unlock(&s->index_lock);
+  for (int i = 0; i < n / 2; i++) { // oldest first
+    searchhit_t tmp = hits[i];
+    hits[i] = hits[n-1-i];
+    hits[n-1-i] = tmp;
+  }
+  return n;
+}
+
+void search_close(search_t *s) {
+// Index everything queued, save the index, stop the indexing thread
+// and free s. Under BL_STATS reports the size and speed of the index
+// as server_shutdown() does for the rest of the server.
+  pthread_mutex_lock(&s->queue_lock);
+  s->stop = 1;
+  pthread_cond_signal(&s->wake);
+  pthread_mutex_unlock(&s->queue_lock);
+  pthread_join(s->thread, NULL);
+  if (getenv("BL_STATS")) {
+    char logname[MAXPATH+4];
+    snprintf(logname, MAXPATH+4, "%s.log", s->server_name);
+    struct stat st;
+    long log_size = stat(logname, &st) == 0 ? st.st_size : 0;
+    fprintf(stderr, "STATS: search index, %ld messages, %ld words, %ld postings, %ld bytes saved (%.1f%% of the log), indexed in %ld usec (%.0f messages/s)\n",
+            s->n_docs, s->n_terms, s->n_postings, s->saved_bytes, log_size ? 100.0 * s->saved_bytes / log_size : 0.0,
+            s->index_usec, s->index_usec ? s->n_docs / (s->index_usec / 1e6) : 0.0);
+  }
+  search_reset(s);
+  free(s->queue);
+  pthread_mutex_destroy(&s->queue_lock);
+  pthread_mutex_destroy(&s->index_lock);
+  pthread_cond_destroy(&s->wake);
+  free(s);
+}
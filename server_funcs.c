@@ -1,4 +1,6 @@
+#define _GNU_SOURCE             // memfd_create() for server_handoff(), ppoll() for BL_BATCH
 #include "blather.h"
+#include <sys/mman.h>
 
 client_t *server_get_client(server_t *server, int idx) {
 // Gets a pointer to the client_t struct at the given index. If the
@@ -8,6 +10,262 @@ client_t *server_get_client(server_t *server, int idx) {
   return server->client + idx;
 }
 
+static void server_index_add(server_t *server, long seq, long off) {
+// ADVANCED: Append an entry to the server's sparse index of the log.
+  if (server->ckpt.n_index == server->max_index) {
+    server->max_index = server->max_index ? server->max_index * 2 : 64;
+    server->index = realloc(server->index, sizeof(logidx_t) * server->max_index);
+    check_fail(server->index == NULL, 1, "couldn't grow the log index\n");
+  }
+  server->index[server->ckpt.n_index].seq = seq;
+  server->index[server->ckpt.n_index].off = off;
+  server->ckpt.n_index++;
+}
+
+static int server_ckpt_matches(int fd, ckpt_t *ckpt, long log_size) {
+// ADVANCED: Check that a checkpoint describes the log open on fd: its
+// last verified record must still be in place, unchanged, and end
+// at the checkpoint's valid offset.
+  if (ckpt->valid_off < sizeof(who_t) || ckpt->valid_off > log_size)
+    return 0;
+  if (ckpt->last_off == 0)
+    return ckpt->valid_off == sizeof(who_t);
+  logscan_t scan;
+  mesg_t msg;
+  logscan_open(&scan, fd, ckpt->last_off);
+  int ok = logscan_next(&scan, &msg) == 1 && scan.rec_crc == ckpt->last_crc
+    && scan.off == ckpt->valid_off;
+  logscan_close(&scan);
+  return ok;
+}
+
+static void server_recover_log(server_t *server) {
+// ADVANCED: Bring the log to a consistent state at startup. Records
+// past the last checkpoint are verified by their checksums and any
+// torn record at the end, left by a crash in the middle of a write,
+// is truncated away. Without a usable checkpoint the whole log is
+// scanned. A log in which no record verifies is refused rather than
+// truncated. Restores the sequence numbering and the log index.
+  long start = clock_usec();
+  char logname[MAXPATH+4];
+  snprintf(logname, MAXPATH+4, "%s.log", server->server_name);
+  int fd = open(logname, O_RDONLY);
+  check_fail(fd == -1, 1, "couldn't open logfile %s\n", logname);
+  struct stat st;
+  check_fail(fstat(fd, &st) == -1, 1, "couldn't examine logfile %s\n", logname);
+
+  logidx_t *index = NULL;
+  ckpt_t ckpt;
+  int have_ckpt = log_read_checkpoint(server->server_name, &ckpt, &index) == 0;
+  if (have_ckpt && !server_ckpt_matches(fd, &ckpt, st.st_size)) {
+    have_ckpt = 0;
+    log_printf("checkpoint does not match log, scanning all of it\n");
+  }
+  server->ckpt = (ckpt_t) {
+    .valid_off = sizeof(who_t),
+  };
+  if (have_ckpt) {
+    for (int i = 0; i < ckpt.n_index; i++)
+      server_index_add(server, index[i].seq, index[i].off);
+    server->ckpt.last_seq = ckpt.last_seq;
+    server->ckpt.valid_off = ckpt.valid_off;
+    server->ckpt.last_off = ckpt.last_off;
+    server->ckpt.last_crc = ckpt.last_crc;
+  }
+  free(index);
+
+  // only the tail written since the checkpoint needs verifying
+  logscan_t scan;
+  mesg_t msg;
+  long scan_from = server->ckpt.valid_off;
+  logscan_open(&scan, fd, scan_from);
+  while (logscan_next(&scan, &msg) == 1) {
+    if (msg.seq > server->ckpt.last_seq)
+      server->ckpt.last_seq = msg.seq;
+    if (msg.kind == BL_SNAPSHOT)
+      server_index_add(server, server->ckpt.last_seq, scan.rec_off);
+    server->ckpt.last_off = scan.rec_off;
+    server->ckpt.last_crc = scan.rec_crc;
+    server->ckpt.valid_off = scan.off;
+  }
+  logscan_close(&scan);
+  close(fd);
+
+  long torn = st.st_size - server->ckpt.valid_off;
+  // a torn tail follows records which did verify; a log with none at
+  // all, such as one written by an older server, is not ours to cut
+  check_fail(torn > 0 && server->ckpt.last_off == 0, 0,
+             "logfile %s holds no record this server can read, move it aside to start a new log\n", logname);
+  if (torn > 0) {
+    check_fail(ftruncate(server->log_fd, server->ckpt.valid_off) == -1, 1, "couldn't truncate logfile %s\n", logname);
+  }
+  lseek(server->log_fd, server->ckpt.valid_off, SEEK_SET);
+  server->seq = server->ckpt.last_seq;
+  log_printf("log recovered in %ld usec: scanned %ld bytes, truncated %ld bytes, last seq %ld\n",
+             clock_usec() - start, server->ckpt.valid_off - scan_from, torn > 0 ? torn : 0, server->seq);
+  server_checkpoint(server);
+}
+
+static void server_log_write(server_t *server, char *buf, int len) {
+// ADVANCED: Append len bytes to the log at its verified length.
+  if (server->uring != NULL) {
+    uring_queue_log(server->uring, server->log_fd, buf, len, server->ckpt.valid_off);
+  } else {
+    int bytes = write(server->log_fd, buf, len);
+    check_fail(bytes != len, 1, "a record logging error occured\n");
+  }
+}
+
+static logz_t *server_logz_open() {
+// ADVANCED: Set up gathering records into compressed blocks if
+// BL_LOGZ asks for it. Returns NULL for plain records.
+  if (getenv("BL_LOGZ") == NULL)
+    return NULL;
+  logz_t *z = malloc(sizeof(logz_t));
+  check_fail(z == NULL, 1, "couldn't allocate log block\n");
+  z->raw = malloc(LOGZ_MAXRAW);
+  z->out = malloc(sizeof(logblock_t) + LZ_BOUND(LOGZ_MAXRAW));
+  check_fail(z->raw == NULL || z->out == NULL, 1, "couldn't allocate log block\n");
+  z->len = 0;
+  z->first_seq = z->last_seq = 0;
+  memset(z->named, 0, MAXCLIENTS);
+  return z;
+}
+
+static void server_logz_close(server_t *server) {
+// ADVANCED: Release the BL_LOGZ block, which must have been sealed.
+  if (server->logz == NULL)
+    return;
+  free(server->logz->raw);
+  free(server->logz->out);
+  free(server->logz);
+  server->logz = NULL;
+}
+
+static void server_log_seal(server_t *server) {
+// ADVANCED: Under BL_LOGZ, compress the records gathered so far into a
+// BL_LOGBLOCK, append it to the log and index it. The dictionary for
+// the block is placed just ahead of its records in z->raw so the
+// block is compressed in one piece. Readers in other processes see
+// records once their block is sealed, which happens every second from
+// server_tick() if not sooner.
+  logz_t *z = server->logz;
+  if (z == NULL || z->len == 0)
+    return;
+  SPAN_BEGIN(span);
+  long start = clock_usec();
+  char dict[LOGZ_DICT];
+  mesg_t snap = {
+    .kind = BL_SNAPSHOT,
+    .name_id = NOID,
+  };
+  int dict_len = mesg_encode(&snap, dict);
+  for (int id = 0; id < MAXCLIENTS; id++) {
+    if (!z->named[id] || z->names[id][0] == '\0')
+      continue;
+    mesg_t map = {
+      .kind = BL_NAMEMAP,
+      .name_id = id,
+    };
+    snprintf(map.name, MAXNAME, "%s", z->names[id]);
+    dict_len += mesg_encode(&map, dict + dict_len);
+  }
+  char *raw = z->raw + LOGZ_DICT - dict_len;
+  memcpy(raw, dict, dict_len);
+
+  logblock_t hdr = {
+    .first_seq = z->first_seq,
+    .last_seq = z->last_seq,
+    .kind = BL_LOGBLOCK,
+    .raw_len = dict_len + z->len,
+  };
+  hdr.comp_len = lz_compress(raw, hdr.raw_len, z->out + sizeof(logblock_t));
+  memcpy(z->out, &hdr, sizeof(logblock_t));
+  int len = sizeof(logblock_t) + hdr.comp_len;
+  hdr.crc = mesg_crc(z->out, len);
+  memcpy(z->out, &hdr, sizeof(logblock_t));
+
+  server_index_add(server, server->ckpt.last_seq, server->ckpt.valid_off);
+  server_log_write(server, z->out, len);
+  if (server->uring != NULL)
+    check_fail(uring_flush(server->uring) != 0, 1, "a record logging error occured\n");
+  server->ckpt.last_off = server->ckpt.valid_off;
+  server->ckpt.last_crc = hdr.crc;
+  server->ckpt.valid_off += len;
+  if (z->last_seq > server->ckpt.last_seq)
+    server->ckpt.last_seq = z->last_seq;
+  server->log_stored += len;
+  server->log_usec += clock_usec() - start;
+  z->len = 0;
+  z->first_seq = z->last_seq = 0;
+  memset(z->named, 0, MAXCLIENTS);
+  SPAN_END(span, "log_seal", len);
+}
+
+static void server_capture_flush(server_t *server) {
+// Write the buffered events of the capture trace.
+  if (server->capture_len == 0)
+    return;
+  int bytes = write(server->capture_fd, server->capture_buf, server->capture_len);
+  check_fail(bytes != server->capture_len, 1, "couldn't write capture trace\n");
+  server->capture_len = 0;
+}
+
+static void server_capture(server_t *server, int event, int conn, mesg_t *mesg) {
+// Record an inbound event in the BL_CAPTURE trace, if capturing, so
+// that bl_replay can feed the same traffic to a server later. mesg is
+// NULL for events which carry no message.
+  if (server->capture_fd == -1)
+    return;
+  if (TRACE_BUF - server->capture_len < MAXTRACE)
+    server_capture_flush(server);
+  trace_t rec = {
+    .usec = clock_usec() - server->capture_start,
+    .event = event,
+    .conn = conn,
+  };
+  server->capture_len += trace_encode(&rec, mesg, server->capture_buf + server->capture_len);
+}
+
+static void server_open_io(server_t *server) {
+// Set up the I/O backend selected by BL_IO, leaving server->uring NULL
+// to use poll().
+  server->uring = NULL;
+  char *io = getenv("BL_IO");
+  if (io != NULL && strcmp(io, "uring") == 0 && server->fed != NULL) {
+    log_printf("federation links are only polled, using poll() rather than io_uring\n");
+  } else if (io != NULL && strcmp(io, "uring") == 0) {
+    server->uring = uring_open(URING_ENTRIES);
+    if (server->uring == NULL)
+      log_printf("io_uring is unavailable, falling back to poll()\n");
+  }
+}
+
+static void server_open_batch(server_t *server) {
+// Set up gathering broadcasts for one write per client if BL_BATCH
+// asks for it, its value being the batching window in microseconds,
+// leaving server->batch NULL to write each broadcast as it is made.
+  server->batch = NULL;
+  server->batch_len = 0;
+  server->batch_count = 0;
+  server->batch_gathered = 0;
+  char *window = getenv("BL_BATCH");
+  if (window == NULL)
+    return;
+  server->batch = malloc(BATCH_BUF);
+  check_fail(server->batch == NULL, 1, "couldn't allocate the broadcast batch\n");
+  server->batch_window = atol(window);
+}
+
+static void server_open_sem(server_t *server) {
+// ADVANCED: Open the semaphore "/server_name.sem" guarding the who_t
+// section of the log, creating it with value 1 if need be.
+  char semname[MAXPATH+5];
+  snprintf(semname,MAXPATH+5,"/%s.sem", server->server_name); //this is actually unsafe. the sem can only have a name len up to 251
+  server->log_sem = sem_open(semname, O_CREAT, S_IRUSR | S_IWUSR, 1);
+  check_fail(server->log_sem == SEM_FAILED, 1, "couldn't open semaphore %s\n", semname);
+}
+
 void server_start(server_t *server, char *server_name, int perms) {
 // Initializes and starts the server with the given name. A join fifo
 // called "server_name.fifo" should be created. Removes any existing
@@ -31,10 +289,49 @@ void server_start(server_t *server, char *server_name, int perms) {
   snprintf(fifoname, MAXPATH+5, "%s.fifo", server->server_name);
   unlink(fifoname);
   mkfifo(fifoname, perms);
-  server->join_fd = open(fifoname, O_RDWR, perms);
+  server->join_fd = open(fifoname, O_RDWR | O_NONBLOCK, perms);
   check_fail(server->join_fd == -1, 1, "couldn't open fifo %s\n", fifoname); //for calls like these, need to fail fast and fail loudly
+  server->joinq = joinq_create(server->server_name);
+  check_fail(server->joinq == NULL, 1, "couldn't create join queue for %s\n", server->server_name);
   server->join_ready = 0;
+  server->join_waiting = 0;
   server->n_clients = 0;
+  server->time_sec = 0;
+  server->seq = 0;
+  server->fed = NULL;
+  server->fed_ready = 0;
+  server->logz = NULL;
+  server->search = NULL;
+  server->n_batches = 0;
+  server->n_batched = 0;
+  server->batch_wait = 0;
+  server->log_records = 0;
+  server->log_bytes = 0;
+  server->log_stored = 0;
+  server->log_usec = 0;
+  server->window = calloc(WINDOW, sizeof(window_t));
+  check_fail(server->window == NULL, 1, "couldn't allocate the message window\n");
+  server->index = NULL;
+  server->max_index = 0;
+  server->n_polls = 0;
+  server->n_handled = 0;
+  server->n_joins = 0;
+  server->capture_fd = -1;
+  server->capture_buf = NULL;
+  server->capture_len = 0;
+  char *capture = getenv("BL_CAPTURE");
+  if (capture != NULL) {
+    server->capture_fd = open(capture, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+    check_fail(server->capture_fd == -1, 1, "couldn't open capture trace %s\n", capture);
+    server->capture_buf = malloc(TRACE_BUF);
+    check_fail(server->capture_buf == NULL, 1, "couldn't allocate capture buffer\n");
+    server->capture_start = clock_usec();
+    tracehdr_t hdr = {
+      .magic = TRACE_MAGIC,
+      .start = server->capture_start,
+    };
+    check_fail(write(server->capture_fd, &hdr, sizeof(hdr)) != sizeof(hdr), 1, "couldn't write capture trace\n");
+  }
 
   if (DO_ADVANCED) {
     // open .log activity record
@@ -42,17 +339,85 @@ void server_start(server_t *server, char *server_name, int perms) {
     snprintf(logname, MAXPATH+4, "%s.log", server->server_name);
     server->log_fd = open(logname, O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR); 
     check_fail(server->log_fd == -1, 1, "couldn't open logfile %s\n", logname);
-    char semname[MAXPATH+5];
-    snprintf(semname,MAXPATH+5,"/%s.sem", server->server_name); //this is actually unsafe. the sem can only have a name len up to 251
-    server->log_sem = sem_open(semname, O_CREAT, S_IRUSR | S_IWUSR, 1);
-    check_fail(server->log_sem == SEM_FAILED, 1, "couldn't open semaphore %s\n", semname);
+    server_open_sem(server);
     server_write_who(server); //document chat members
-    lseek(server->log_fd,0,SEEK_END);
+    server_recover_log(server); //positions log_fd after the last intact record
+    server->logz = server_logz_open();
+    server->search = search_open(server); //indexes what the log holds beyond the saved index
   }
+  server->fed = fed_open(server); //a follower takes up the leader's sequence numbering
+  server_open_io(server);
+  server_open_batch(server);
+  server->window_first = server->seq + 1;
 
   log_printf("END: server_start()\n");
 }
 
+static window_t *server_window_slot(server_t *server, long seq) {
+// Returns the window slot holding broadcast seq or NULL if it is not
+// there: a federated server skips broadcasts about members it does
+// not know, leaving gaps in the sequence numbers it delivered.
+  window_t *slot = server->window + seq % WINDOW;
+  return slot->buf != NULL && slot->seq == seq ? slot : NULL;
+}
+
+static void server_free_window(server_t *server) {
+// Drop the window's references to recent broadcasts and free it.
+  for (int i = 0; i < WINDOW; i++) {
+    if (server->window[i].buf != NULL)
+      pool_put(server->window[i].buf);
+  }
+  free(server->window);
+}
+
+static void server_report_stats(server_t *server) {
+// Report how many system calls the server made per message read from
+// clients. read()/write() family calls are counted by the kernel in
+// /proc/self/io; poll() and io_uring_enter() calls are counted here.
+// Printed even under BL_NOLOG so that benchmarks can silence logging.
+//
+// Under BL_BATCH, report how many broadcasts went out per write and
+// how long they waited to be written on average.
+//
+// The message pool's counts show how many buffers sending took from
+// the heap rather than the pool, and after how many messages the
+// last of them was allocated.
+//
+// ADVANCED: Also report how well the log format selected by BL_LOGZ
+// packs records and how fast records are written, counting the time
+// spent encoding, compressing and writing (or for io_uring queueing)
+// them, per megabyte of plain records.
+  long syscr = 0, syscw = 0;
+  FILE *io = fopen("/proc/self/io", "r");
+  if (io != NULL) {
+    char line[128];
+    while (fgets(line, sizeof(line), io) != NULL) {
+      sscanf(line, "syscr: %ld", &syscr);
+      sscanf(line, "syscw: %ld", &syscw);
+    }
+    fclose(io);
+  }
+  long enters = server->uring ? uring_enters(server->uring) : 0;
+  long total = syscr + syscw + server->n_polls + enters;
+  fprintf(stderr, "STATS: %s backend, %ld messages, %ld syscalls (%ld read, %ld write, %ld poll, %ld io_uring_enter), %.2f per message\n",
+             server->uring ? "io_uring" : "poll", server->n_handled, total, syscr, syscw,
+             server->n_polls, enters, server->n_handled ? (double) total / server->n_handled : 0.0);
+  if (server->batch != NULL)
+    fprintf(stderr, "STATS: batching, %ld usec window, %ld broadcasts in %ld writes per client, %.1f per write, %.1f usec average wait\n",
+            server->batch_window, server->n_batched, server->n_batches,
+            server->n_batches ? (double) server->n_batched / server->n_batches : 0.0,
+            server->n_batched ? (double) server->batch_wait / server->n_batched : 0.0);
+  poolstats_t pool;
+  pool_stats(&pool);
+  fprintf(stderr, "STATS: message pool, %ld buffers used, %ld from the heap, the last at buffer %ld, %ld at most in use, %.5f heap allocations per buffer\n",
+          pool.gets, pool.heap, pool.last_heap, pool.peak, pool.gets ? (double) pool.heap / pool.gets : 0.0);
+  if (DO_ADVANCED)
+    fprintf(stderr, "STATS: %s log, %ld records, %ld bytes as plain records, %ld bytes stored, ratio %.2f, %.1f MB/s\n",
+            server->logz ? "compressed" : "plain", server->log_records, server->log_bytes, server->log_stored,
+            server->log_stored ? (double) server->log_bytes / server->log_stored : 0.0,
+            server->log_usec ? (double) server->log_bytes / server->log_usec : 0.0);
+}
+
 void server_shutdown(server_t *server) {
 // Shut down the server. Close the join FIFO and unlink (remove) it so
 // that no further clients can join. Send a BL_SHUTDOWN message to all
@@ -69,23 +434,304 @@ void server_shutdown(server_t *server) {
   char fifoname[MAXPATH+5];
   snprintf(fifoname, MAXPATH+5, "%s.fifo", server->server_name);
   unlink(fifoname);
+  joinq_close(server->joinq);
+  joinq_unlink(server->server_name);
   mesg_t shtdn_msg = {
     .kind = BL_SHUTDOWN,
+    .name_id = NOID,
   };
   server_broadcast(server, &shtdn_msg);
   for (int i = server->n_clients -1 ; i >= 0; i--) {
     server_remove_client(server, i);
   }
+  if (server->fed != NULL)
+    fed_close(server); //the other servers disconnect this one's clients
   if (DO_ADVANCED) {
+    server_checkpoint(server);
+    if (server->search != NULL)
+      search_close(server->search);
     close(server->log_fd);
     sem_close(server->log_sem);
     char semname[MAXPATH+5];
     snprintf(semname,MAXPATH+5,"/%s.sem",server->server_name);
     sem_unlink(semname);
   }
+  if (server->capture_fd != -1) {
+    server_capture_flush(server);
+    close(server->capture_fd);
+    free(server->capture_buf);
+  }
+  if (getenv("BL_STATS"))
+    server_report_stats(server);
+  if (server->uring != NULL)
+    uring_close(server->uring);
+  server_logz_close(server);
+  server_free_window(server);
+  free(server->index);
+  free(server->batch);
   log_printf("END: server_shutdown()\n");
 }
 
+static void handoff_write(int fd, void *buf, long len) {
+// Append len bytes to the handoff state, failing loudly if they do
+// not all fit.
+  check_fail(write(fd, buf, len) != len, 1, "couldn't save server state for the handoff\n");
+}
+
+static void handoff_read(int fd, void *buf, long len) {
+// Take the next len bytes of the handoff state.
+  check_fail(read(fd, buf, len) != len, 1, "couldn't read server state handed off\n");
+}
+
+void server_handoff(server_t *server, char *exe, char **argv) {
+// Replace the running server with a fresh exec of exe, as after an
+// upgrade, without disconnecting anyone. Input from clients stops
+// being read, then the client table, sequence numbering, window of
+// recent broadcasts and log index are written to a memfd whose
+// descriptor is passed in BL_HANDOFF along with every other open
+// descriptor. The new process picks them up in server_resume() and
+// reports how long the server was paused. Clients only see their
+// messages delayed by the pause. If exe cannot be run the server
+// carries on as it was.
+  long start = clock_usec();
+  if (server->fed != NULL) {
+    log_printf("federation links can't be handed off, handoff abandoned\n");
+    return;
+  }
+  if (access(exe, X_OK) != 0) {
+    log_printf("can't run %s, handoff abandoned\n", exe);
+    return;
+  }
+  int fd = memfd_create("blather-handoff", 0); //not close-on-exec so the new process inherits it
+  if (fd == -1) {
+    log_printf("couldn't create handoff state, handoff abandoned\n");
+    return;
+  }
+  if (server->capture_fd != -1)
+    server_capture_flush(server);
+  server_flush(server, 1);      //gathered broadcasts would otherwise be lost
+  if (DO_ADVANCED)
+    server_log_seal(server); //the new process starts a fresh block
+  if (server->search != NULL) {
+    search_close(server->search); //the new process loads the saved index
+    server->search = NULL;
+  }
+  if (server->uring != NULL)
+    uring_quiesce(server->uring); //reads in flight would take input the new process never sees
+
+  long lo = server->seq - WINDOW + 1; //only the valid part of the window is passed on
+  if (lo < server->window_first)
+    lo = server->window_first;
+  handoff_t hdr = {
+    .magic = HANDOFF_MAGIC,
+    .client_size = sizeof(client_t),
+    .start = start,
+    .join_fd = server->join_fd,
+    .log_fd = DO_ADVANCED ? server->log_fd : -1,
+    .capture_fd = server->capture_fd,
+    .n_clients = server->n_clients,
+    .time_sec = server->time_sec,
+    .n_joins = server->n_joins,
+    .seq = server->seq,
+    .window_first = lo,
+    .n_window = server->seq - lo + 1,
+    .ckpt = server->ckpt,
+    .n_polls = server->n_polls,
+    .n_handled = server->n_handled,
+    .capture_start = server->capture_start,
+    .log_records = server->log_records,
+    .log_bytes = server->log_bytes,
+    .log_stored = server->log_stored,
+    .log_usec = server->log_usec,
+    .n_batches = server->n_batches,
+    .n_batched = server->n_batched,
+    .batch_wait = server->batch_wait,
+  };
+  handoff_write(fd, &hdr, sizeof(hdr));
+  handoff_write(fd, server->client, sizeof(client_t) * server->n_clients);
+  for (long seq = lo; seq <= server->seq; seq++) {
+    window_t *slot = server_window_slot(server, seq);
+    int len = slot != NULL ? slot->buf->len : 0;
+    handoff_write(fd, server->window[seq % WINDOW].name, MAXNAME);
+    handoff_write(fd, &len, sizeof(int));
+    if (slot != NULL)
+      handoff_write(fd, slot->buf->data, len);
+  }
+  handoff_write(fd, server->index, sizeof(logidx_t) * server->ckpt.n_index);
+  for (int i = 0; i < server->n_clients; i++) {
+    client_t *cur = server_get_client(server, i);
+    char *buf = cur->held;      //still held from an earlier handoff
+    int len = cur->held_len;
+    if (server->uring != NULL)
+      len = uring_buffered(server->uring, cur->id, &buf);
+    handoff_write(fd, &len, sizeof(len));
+    handoff_write(fd, buf, len);
+    free(cur->held);            //the exec failing resumes from what was written
+    cur->held = NULL;
+  }
+
+  // everything but the descriptors is rebuilt by the new process
+  if (server->uring != NULL)
+    uring_close(server->uring);
+  joinq_close(server->joinq);
+  if (DO_ADVANCED)
+    sem_close(server->log_sem);
+  server_logz_close(server);
+  server_free_window(server);
+  free(server->index);
+  free(server->capture_buf);
+  free(server->batch);
+  char fdstr[16];
+  snprintf(fdstr, 16, "%d", fd);
+  setenv("BL_HANDOFF", fdstr, 1);
+  execv(exe, argv);
+
+  // still here so exec failed; pick up again from the saved state
+  log_printf("couldn't exec %s, resuming\n", exe);
+  unsetenv("BL_HANDOFF");
+  char server_name[MAXPATH];
+  snprintf(server_name, MAXPATH, "%s", server->server_name);
+  server_resume(server, server_name, fd);
+}
+
+void server_resume(server_t *server, char *server_name, int fd) {
+// Start the server from the state a previous server process left in
+// fd for it by server_handoff() in place of server_start(). The join
+// FIFO, log, clients' FIFOs and capture trace are the descriptors the
+// previous process had open. Closes fd.
+  snprintf(server->server_name, MAXPATH, "%s", server_name);
+  handoff_t hdr;
+  check_fail(lseek(fd, 0, SEEK_SET) == -1, 1, "couldn't read server state handed off\n");
+  handoff_read(fd, &hdr, sizeof(hdr));
+  check_fail(hdr.magic != HANDOFF_MAGIC || hdr.client_size != sizeof(client_t), 0,
+             "server state handed off is from an incompatible server\n");
+  server->join_fd = hdr.join_fd;
+  server->joinq = joinq_open(server->server_name);
+  check_fail(server->joinq == NULL, 1, "couldn't open join queue for %s\n", server->server_name);
+  server->join_ready = 0;
+  server->join_waiting = 1;     //whatever the previous process left queued is looked at once
+  server->n_clients = hdr.n_clients;
+  handoff_read(fd, server->client, sizeof(client_t) * hdr.n_clients);
+  server->time_sec = hdr.time_sec;
+  server->log_fd = hdr.log_fd;
+  server->seq = hdr.seq;
+  server->window_first = hdr.window_first;
+  server->window = calloc(WINDOW, sizeof(window_t));
+  check_fail(server->window == NULL, 1, "couldn't allocate the message window\n");
+  for (long seq = hdr.window_first; seq < hdr.window_first + hdr.n_window; seq++) {
+    window_t *slot = server->window + seq % WINDOW;
+    int len;
+    handoff_read(fd, slot->name, MAXNAME);
+    handoff_read(fd, &len, sizeof(int));
+    if (len == 0)
+      continue;                 //a federated server's gap in the seq space
+    check_fail(len < sizeof(wire_t) || len > MAXWIRE, 0, "server state handed off is garbled\n");
+    slot->buf = pool_get(len);
+    handoff_read(fd, slot->buf->data, len);
+    slot->buf->len = len;
+    slot->seq = seq;
+  }
+  server->ckpt = hdr.ckpt;
+  if (DO_ADVANCED)              //io_uring writes at offsets, leaving log_fd where recovery put it
+    lseek(server->log_fd, server->ckpt.valid_off, SEEK_SET);
+  server->max_index = hdr.ckpt.n_index;
+  server->index = NULL;
+  if (hdr.ckpt.n_index > 0) {
+    server->index = malloc(sizeof(logidx_t) * hdr.ckpt.n_index);
+    check_fail(server->index == NULL, 1, "couldn't allocate the log index\n");
+    handoff_read(fd, server->index, sizeof(logidx_t) * hdr.ckpt.n_index);
+  }
+  server->n_polls = hdr.n_polls;
+  server->n_handled = hdr.n_handled;
+  server->n_joins = hdr.n_joins;
+  server->capture_fd = hdr.capture_fd;
+  server->capture_buf = NULL;
+  server->capture_len = 0;
+  server->capture_start = hdr.capture_start;
+  if (server->capture_fd != -1) {
+    server->capture_buf = malloc(TRACE_BUF);
+    check_fail(server->capture_buf == NULL, 1, "couldn't allocate capture buffer\n");
+  }
+  server->fed = NULL;
+  server->fed_ready = 0;
+  server->logz = DO_ADVANCED ? server_logz_open() : NULL;
+  server->search = DO_ADVANCED ? search_open(server) : NULL; //saved by the previous process
+  server->log_records = hdr.log_records;
+  server->log_bytes = hdr.log_bytes;
+  server->log_stored = hdr.log_stored;
+  server->log_usec = hdr.log_usec;
+  server->n_batches = hdr.n_batches;
+  server->n_batched = hdr.n_batched;
+  server->batch_wait = hdr.batch_wait;
+  server_open_io(server);
+  server_open_batch(server);
+  for (int i = 0; i < server->n_clients; i++) {
+    client_t *cur = server_get_client(server, i);
+    cur->data_ready = 0;
+    cur->held = NULL;
+    cur->held_len = 0;
+    if (server->uring != NULL)
+      uring_watch_client(server->uring, cur->id, cur->to_server_fd);
+    int len;
+    char buf[URING_RBUF];
+    handoff_read(fd, &len, sizeof(len));
+    check_fail(len < 0 || len > URING_RBUF, 0, "server state handed off is garbled\n");
+    handoff_read(fd, buf, len);
+    if (server->uring != NULL) {
+      uring_prefill(server->uring, cur->id, buf, len);
+    } else if (len > 0) {       //read ahead by io_uring; poll() must hand these over first
+      cur->held = malloc(len);
+      check_fail(cur->held == NULL, 1, "couldn't allocate input held for client '%s'\n", cur->name);
+      memcpy(cur->held, buf, len);
+      cur->held_len = len;
+      dbg_printf("holding %d bytes from client '%s' read by io_uring before the handoff\n", len, cur->name);
+    }
+  }
+  close(fd);
+  if (DO_ADVANCED)
+    server_open_sem(server);
+  log_printf("resumed %d clients after a handoff pause of %ld usec\n", server->n_clients, clock_usec() - hdr.start);
+}
+
+static int server_alloc_id(server_t *server) {
+// Find the lowest session id not held by any connected client. Ids of
+// departed clients are reused so that they stay below MAXCLIENTS.
+  int used[MAXCLIENTS] = {0};
+  for (int i = 0; i < server->n_clients; i++) {
+    used[server_get_client(server, i)->id] = 1;
+  }
+  for (int i = 0; server->fed != NULL && i < MAXCLIENTS; i++) {
+    if (fed_member(server->fed, i) != NULL)
+      used[i] = 1; //members on other servers and departures not yet sequenced
+  }
+  int id = 0;
+  while (used[id])
+    id++;
+  return id;
+}
+
+static char *server_find_id(server_t *server, int id) {
+// Returns the name of the member of the room holding the given
+// session id or NULL if no one holds it.
+  if (server->fed != NULL)
+    return id >= 0 && id < MAXCLIENTS ? fed_member(server->fed, id) : NULL;
+  for (int i = 0; i < server->n_clients; i++) {
+    if (server->client[i].id == id)
+      return server->client[i].name;
+  }
+  return NULL;
+}
+
+static void server_send_namemap(server_t *server, client_t *to, int id, char *name) {
+// Tell client 'to' which name belongs to session id 'id'.
+  mesg_t msg = {
+    .kind = BL_NAMEMAP,
+    .name_id = id,
+  };
+  snprintf(msg.name, MAXNAME, "%s", name);
+  check_fail(mesg_write(to->to_client_fd, &msg) != 0, 1, "an issue messaging the client '%s' occurred\n", to->name);
+}
+
 int server_add_client(server_t *server, join_t *join) {
 // Adds a client to the server according to the parameter join which
 // should have fileds such as name filed in.  The client data is
@@ -100,8 +746,12 @@ int server_add_client(server_t *server, join_t *join) {
   log_printf("BEGIN: server_add_client()\n");
   if (server->n_clients == MAXCLIENTS)
     return 1;
+  server_flush(server, 1);      //broadcasts gathered before the join are not for the newcomer
   client_t *newclient = server_get_client(server, server->n_clients);
+  newclient->id = server_alloc_id(server);
   newclient->data_ready = 0;
+  newclient->held = NULL;
+  newclient->held_len = 0;
   newclient->last_contact_time = server->time_sec;
   strncpy(newclient->name, join->name, MAXNAME);
   strncpy(newclient->to_server_fname, join->to_server_fname, MAXPATH);
@@ -110,6 +760,10 @@ int server_add_client(server_t *server, join_t *join) {
   strncpy(newclient->to_client_fname, join->to_client_fname, MAXPATH);
   newclient->to_client_fd = open(newclient->to_client_fname, O_RDWR, S_IRUSR | S_IWUSR );
   check_fail(newclient->to_client_fd == -1, 1, "couldn't open client %s's comm channel\n", newclient->name);
+  if (server->fed != NULL)
+    fed_join(server->fed, newclient->id, newclient->name);
+  if (server->uring != NULL)
+    uring_watch_client(server->uring, newclient->id, newclient->to_server_fd);
   server->n_clients++;
   log_printf("END: server_add_client()\n");
   return 0;
@@ -120,8 +774,12 @@ int server_remove_client(server_t *server, int idx) {
 // disconnected. Close fifos associated with the client and remove
 // them.  Shift the remaining clients to lower indices of the client[]
 // preserving their order in the array; decreases n_clients.
+  server_flush(server, 1);      //the client leaving still gets what was gathered before
   client_t *client = server_get_client(server, idx);
   dbg_printf("Removing client %d, '%s'\n", idx, client->name);
+  if (server->uring != NULL)
+    uring_unwatch_client(server->uring, client->id);
+  free(client->held);
   close(client->to_server_fd);
   unlink(client->to_server_fname);
   close(client->to_client_fd);
@@ -139,18 +797,186 @@ int server_broadcast(server_t *server, mesg_t *mesg) {
 //
 // ADVANCED: Log the broadcast message unless it is a PING which
 // should not be written to the log.
+//
+// Every message except a PING or SHUTDOWN is stamped with the next
+// sequence number and kept in the server's window of recent messages
+// for clients which rejoin after missing some. All are timestamped.
   dbg_printf("broadcasting message #%d from user %s\n", mesg->kind, mesg->name);
+  mesg->seq = 0;
+  mesg->tstamp = clock_usec();
+  if (mesg->kind != BL_PING && mesg->kind != BL_SHUTDOWN) {
+    if (server->fed != NULL && fed_relay(server, mesg))
+      return 0; //a follower delivers it once the leader has sequenced it
+    mesg->seq = ++server->seq;
+  }
+  return server_deliver(server, mesg);
+}
+
+static void server_write_clients(server_t *server, char *wire, int len) {
+// Write len bytes of encoded broadcasts to every client. With io_uring
+// the writes are only queued, to go out with the next uring_flush().
+  SPAN_BEGIN(span);
   for (int i = 0; i < server->n_clients; i++) {
     client_t *cur = server_get_client(server, i);
-    int bytes = write(cur->to_client_fd, mesg, sizeof(mesg_t)); 
-    check_fail(bytes != sizeof(mesg_t), 1, "an issue messaging the client '%s' occurred\n", cur->name);
+    if (server->uring != NULL) {
+      uring_queue_write(server->uring, cur->to_client_fd, wire, len);
+      continue;
+    }
+    for (int off = 0, bytes; off < len; off += bytes) { //a batch may exceed PIPE_BUF and go out in parts
+      bytes = write(cur->to_client_fd, wire + off, len - off);
+      check_fail(bytes <= 0, 1, "an issue messaging the client '%s' occurred\n", cur->name);
+    }
+  }
+  SPAN_END(span, "write_clients", server->n_clients);
+}
+
+int server_deliver(server_t *server, mesg_t *mesg) {
+// Send a broadcast which server_broadcast() or, for federated
+// servers, the leader has stamped to all clients, keep it in the
+// window and log it as server_broadcast() describes. Under BL_BATCH
+// the broadcast is gathered for server_flush() to write instead.
+  SPAN_BEGIN(span);
+  msgbuf_t *buf = pool_encode(mesg); //encode once for all recipients, the window and the log
+  if (mesg->seq != 0) {
+    window_t *slot = server->window + mesg->seq % WINDOW;
+    snprintf(slot->name, MAXNAME, "%s", mesg->name);
+    if (slot->buf != NULL)
+      pool_put(slot->buf);      //the broadcast WINDOW back falls out of the window
+    slot->buf = pool_ref(buf);
+    slot->seq = mesg->seq;
+  }
+  if (server->batch != NULL) {
+    if (server->batch_len + buf->len > BATCH_BUF)
+      server_flush(server, 1);
+    long now = clock_usec();
+    if (server->batch_count == 0)
+      server->batch_start = now;
+    memcpy(server->batch + server->batch_len, buf->data, buf->len);
+    server->batch_len += buf->len;
+    server->batch_count++;
+    server->batch_gathered += now;
+  } else {
+    server_write_clients(server, buf->data, buf->len);
   }
   if (DO_ADVANCED && mesg->kind != BL_PING) {
-    server_log_message(server, mesg);
+    server_log_message(server, mesg, buf);
   }
+  if (server->uring != NULL && server->batch == NULL) // the writes to every client and the log append go out in one batch
+    check_fail(uring_flush(server->uring) != 0, 1, "an issue messaging the clients occurred\n");
+  if (server->fed != NULL && mesg->seq != 0)
+    fed_delivered(server, mesg, buf);
+  pool_put(buf);
+  SPAN_END(span, "deliver", mesg->kind);
   return 0;
 }
 
+void server_flush(server_t *server, int force) {
+// Under BL_BATCH, write the broadcasts gathered by server_deliver() to
+// every client at once if force is set or the oldest of them has
+// waited for the batching window. bl_server calls this after each
+// pass of its loop, so a window of 0 writes what one pass gathered;
+// the server also forces it before clients join or leave so that
+// each client gets exactly the broadcasts made while it is present.
+  if (server->batch == NULL || server->batch_count == 0)
+    return;
+  long now = clock_usec();
+  if (!force && now - server->batch_start < server->batch_window)
+    return;
+  SPAN_BEGIN(span);
+  server_write_clients(server, server->batch, server->batch_len);
+  if (server->uring != NULL)
+    check_fail(uring_flush(server->uring) != 0, 1, "an issue messaging the clients occurred\n");
+  server->n_batches++;
+  server->n_batched += server->batch_count;
+  server->batch_wait += server->batch_count * now - server->batch_gathered;
+  SPAN_END(span, "flush", server->batch_count);
+  server->batch_len = 0;
+  server->batch_count = 0;
+  server->batch_gathered = 0;
+}
+
+static long server_flush_due(server_t *server) {
+// Returns the microseconds until server_flush() writes the gathered
+// broadcasts or -1 if none are waiting.
+  if (server->batch == NULL || server->batch_count == 0)
+    return -1;
+  long left = server->batch_start + server->batch_window - clock_usec();
+  return left > 0 ? left : 0;
+}
+
+static int server_held_mesg(client_t *client) {
+// Returns 1 if the bytes held for client from before a handoff hold a
+// whole message, or garbage, so handling it needs no more input.
+  mesg_t msg;
+  return client->held != NULL && mesg_decode(client->held, client->held_len, &msg) != 0;
+}
+
+static int server_read_fill(int fd, char *buf, int *len, int want) {
+// Read from fd until buf holds want bytes. Returns 0 on success and
+// -1 if the input ends or fails first.
+  while (*len < want) {
+    int bytes = read(fd, buf + *len, want - *len);
+    if (bytes <= 0)
+      return -1;
+    *len += bytes;
+  }
+  return 0;
+}
+
+static int server_read_held(client_t *client, mesg_t *msg) {
+// The poll() counterpart of uring_read_mesg() for a client with bytes
+// held from before a handoff: the next message is taken from them and
+// completed from to_server_fd if they end part way through it.
+// Returns 1 on success and -1 on error, as mesg_read() does.
+  char buf[MAXWIRE];
+  int len = client->held_len < MAXWIRE ? client->held_len : MAXWIRE;
+  memcpy(buf, client->held, len);
+  wire_t hdr;
+  if (server_read_fill(client->to_server_fd, buf, &len, sizeof(wire_t)) != 0)
+    return -1;
+  memcpy(&hdr, buf, sizeof(wire_t));
+  if (hdr.body_len < 0 || hdr.body_len >= MAXLINE)
+    return -1;
+  int want = sizeof(wire_t) + hdr.body_len;
+  if (server_read_fill(client->to_server_fd, buf, &len, want) != 0)
+    return -1;
+  int used = want < client->held_len ? want : client->held_len;
+  client->held_len -= used;
+  memmove(client->held, client->held + used, client->held_len);
+  if (client->held_len == 0) {
+    free(client->held);
+    client->held = NULL;
+  }
+  return mesg_decode(buf, want, msg) > 0 ? 1 : -1;
+}
+
+static int server_join_room(server_t *server) {
+// Returns 1 if joins left queued while the server was full can now be
+// taken, which no doorbell will announce.
+  return server->join_waiting && server->n_clients < MAXCLIENTS;
+}
+
+static void server_check_sources_uring(server_t *server) {
+// The io_uring counterpart of server_check_sources(): reads stay
+// posted on every client so readiness is known once a whole message
+// has arrived in the client's buffer.
+  log_printf("io_uring waiting on %d input sources\n", server->n_clients+1);
+  SPAN_BEGIN(span);
+  int ret = uring_wait(server->uring, server->join_fd, server_join_room(server) ? 0 : server_flush_due(server));
+  SPAN_END(span, "poll", server->n_clients+1);
+  if (ret == -1) {
+    log_printf("io_uring wait interrupted by a signal\n");
+    return;
+  }
+  server->join_ready = uring_join_ready(server->uring) || server_join_room(server);
+  log_printf("join_ready = %d\n",server->join_ready);
+  for (int i = 0; i < server->n_clients; i++) {
+    client_t *cur = server_get_client(server, i);
+    cur->data_ready = uring_has_mesg(server->uring, cur->id);
+    log_printf("client %d '%s' data_ready = %d\n",i,cur->name,cur->data_ready);
+  }
+}
+
 void server_check_sources(server_t *server) {
 // Checks all sources of data for the server to determine if any are
 // ready for reading. Sets the servers join_ready flag and the
@@ -167,7 +993,17 @@ void server_check_sources(server_t *server) {
 // log_printf("client %d '%s' data_ready = %d\n",...)         // whether client has data ready
 // log_printf("END: server_check_sources()\n");               // at end of function
   log_printf("BEGIN: server_check_sources()\n");
-  struct pollfd pfds[MAXCLIENTS + 1]; //clients + join_fd  
+  if (server->uring != NULL) {
+    server_check_sources_uring(server);
+    log_printf("END: server_check_sources()\n");
+    return;
+  }
+  struct pollfd pfds[MAXCLIENTS + MAXPEERS + 2]; //clients + join_fd + federation
+  int n_fed = 0;
+  if (server->fed != NULL) {
+    fed_flush(server->fed); //whatever was relayed during the last pass goes out in one batch per link
+    n_fed = fed_pollfds(server->fed, pfds + server->n_clients + 1);
+  }
   pfds[0].fd = server->join_fd;
   pfds[0].events = POLLIN;                                
   for (int i = 0; i < server->n_clients; i++) {
@@ -175,7 +1011,16 @@ void server_check_sources(server_t *server) {
     pfds[i+1].events = POLLIN;                
   }           
   log_printf("poll()'ing to check %d input sources\n",server->n_clients+1);
-  int ret = poll(pfds, server->n_clients + 1, -1);
+  long due = server_join_room(server) ? 0 : server_flush_due(server); //gathered broadcasts bound the wait
+  for (int i = 0; i < server->n_clients; i++) {
+    if (server_held_mesg(server_get_client(server, i)))
+      due = 0;                  //a message held from before a handoff is ready now
+  }
+  struct timespec ts = { .tv_sec = due / 1000000, .tv_nsec = due % 1000000 * 1000 };
+  SPAN_BEGIN(span);
+  int ret = ppoll(pfds, server->n_clients + 1 + n_fed, due >= 0 ? &ts : NULL, NULL);
+  SPAN_END(span, "poll", server->n_clients + 1 + n_fed);
+  server->n_polls++;
   log_printf("poll() completed with return value %d\n",ret);
   if (ret == -1 && errno == EINTR) {
     log_printf("poll() interrupted by a signal\n");
@@ -185,14 +1030,16 @@ void server_check_sources(server_t *server) {
   check_fail(ret == -1, 1, "the sever is having trouble with its comms channels\n");
   
   // indicate which sources have been reported as ready by poll()
-  if (pfds[0].revents & POLLIN) {
+  if (pfds[0].revents & POLLIN || server_join_room(server)) {
     server->join_ready = 1;
   }
+  if (n_fed > 0)
+    server->fed_ready = fed_check(server->fed, pfds + server->n_clients + 1, n_fed);
   log_printf("join_ready = %d\n",server->join_ready);
   int j=0;
   for(int i = 1; i < server->n_clients + 1; i++) {
     client_t *cur = server_get_client(server, i-1);
-    if( pfds[i].revents & POLLIN ){                            
+    if( pfds[i].revents & POLLIN || server_held_mesg(cur) ){
       cur->data_ready = 1;
       j++;
     }
@@ -207,29 +1054,75 @@ int server_join_ready(server_t *server) {
   return server->join_ready;
 }
 
+static int server_join_client(server_t *server, join_t *join) {
+// Add the client of a join request, bring it up to date and announce
+// it to everyone. Returns 0 on success and 1 if the server is full.
+  log_printf("join request for new client '%s'\n",join->name);
+  mesg_t req = {
+    .kind = BL_JOINED,
+    .seq = join->last_seq,
+    .name_id = NOID,
+  };
+  strncpy(req.name, join->name, MAXNAME);
+  server_capture(server, TRACE_JOIN, server->n_joins++, &req);
+  if (server_add_client(server, join) != 0)
+    return 1;
+  client_t *newclient = server_get_client(server, server->n_clients-1);
+  newclient->conn = server->n_joins-1;
+  if (join->last_seq > 0) {
+    int count = server_catch_up(server, newclient, join->last_seq);
+    log_printf("client '%s' caught up on %d messages after %ld\n", newclient->name, count, join->last_seq);
+  }
+  // the newcomer learns the ids of everyone already present once, up front
+  for (int i = 0; server->fed == NULL && i < server->n_clients-1; i++) {
+    client_t *cur = server_get_client(server, i);
+    server_send_namemap(server, newclient, cur->id, cur->name);
+  }
+  for (int id = 0; server->fed != NULL && id < MAXCLIENTS; id++) {
+    char *name = fed_member(server->fed, id); //everyone in the room, on any server
+    if (name != NULL && id != newclient->id)
+      server_send_namemap(server, newclient, id, name);
+  }
+  mesg_t msg = {
+    .kind = BL_JOINED,
+    .name_id = newclient->id,
+  };
+  strncpy(msg.name, newclient->name, MAXNAME);
+  server_broadcast(server, &msg);
+  return 0;
+}
+
 int server_handle_join(server_t *server){
 // Call this function only if server_join_ready() returns true. Read a 
 // join request and add the new client to the server. After finishing,
 // set the servers join_ready flag to 0.
 //
+// Join requests arrive through the shared memory join queue; the
+// join FIFO only carries one doorbell byte per request. All doorbells
+// waiting are drained and every published request is handled, so a
+// burst of joiners is consumed in one call. Requests are left queued
+// while the server is full; server_check_sources() comes back for
+// them once a client leaves, as their doorbells are already drained.
+//
 // LOG Messages:
 // log_printf("BEGIN: server_handle_join()\n");               // at beginnning of function
 // log_printf("join request for new client '%s'\n",...);      // reports name of new client
 // log_printf("END: server_handle_join()\n");                 // at end of function
   log_printf("BEGIN: server_handle_join()\n");
-  join_t join;
-  int bytes = read(server->join_fd, &join, sizeof(join_t));
-  check_fail(bytes != sizeof(join_t), 1, "an join error occurred\n");
-  log_printf("join request for new client '%s'\n",join.name);
-  server_add_client(server, &join);
   server->join_ready = 0;
-  mesg_t msg = {
-    .kind = BL_JOINED,
-  };
-  strncpy(msg.name, join.name, MAXNAME);
-  server_broadcast(server, &msg);
+  char bells[PIPE_BUF];
+  while (read(server->join_fd, bells, PIPE_BUF) == PIPE_BUF)
+    ; //join_fd is non-blocking so this stops once the doorbells are drained
+  joinrec_t rec;
+  join_t join;
+  int ret = 0;
+  while (ret == 0 && server->n_clients < MAXCLIENTS && joinq_pop(server->joinq, &rec)) {
+    joinq_to_join(&rec, &join);
+    ret = server_join_client(server, &join);
+  }
+  server->join_waiting = server->n_clients == MAXCLIENTS;
   log_printf("END: server_handle_join()\n");
-  return 0;
+  return ret;
 }
 
 int server_client_ready(server_t *server, int idx) {
@@ -238,6 +1131,66 @@ int server_client_ready(server_t *server, int idx) {
   return server_get_client(server, idx)->data_ready;
 }
 
+static void server_search(server_t *server, client_t *client, char *terms) {
+// ADVANCED: Answer "%search <terms>" from client with a BL_FOUND for
+// each of the most recent SEARCH_HITS chat messages holding every
+// term, oldest first, then a BL_FOUND with no name saying how many
+// matched. Messages still in the window are taken from memory, older
+// ones are read back from the log at the offset the index gives.
+  SPAN_BEGIN(span);
+  searchhit_t hits[SEARCH_HITS];
+  long total;
+  int n = search_query(server->search, terms, hits, SEARCH_HITS, &total);
+  long lo = server->seq - WINDOW + 1; //oldest message still in the window
+  if (lo < server->window_first)
+    lo = server->window_first;
+  int fd = -1;
+  for (int i = 0; i < n; i++) {
+    mesg_t msg;
+    int found = 0;
+    if (hits[i].seq >= lo) {
+      window_t *slot = server_window_slot(server, hits[i].seq);
+      found = slot != NULL && mesg_decode(slot->buf->data, slot->buf->len, &msg) > 0;
+    } else {
+      if (fd == -1) {
+        server_log_seal(server); //a hit may still be gathered for a BL_LOGZ block
+        char logname[MAXPATH+4];
+        snprintf(logname, MAXPATH+4, "%s.log", server->server_name);
+        fd = open(logname, O_RDONLY);
+        check_fail(fd == -1, 1, "couldn't open logfile %s\n", logname);
+      }
+      logscan_t scan;
+      logscan_open(&scan, fd, hits[i].off);
+      while (logscan_next(&scan, &msg) == 1 && msg.seq <= hits[i].seq) {
+        if (msg.seq == hits[i].seq) {
+          found = 1;
+          break;
+        }
+      }
+      logscan_close(&scan);
+    }
+    if (!found || msg.kind != BL_MESG)
+      continue;
+    mesg_t hit = {
+      .kind = BL_FOUND,
+      .name_id = NOID,
+      .tstamp = msg.tstamp,
+    };
+    snprintf(hit.name, MAXNAME, "%s", hits[i].name);
+    snprintf(hit.body, MAXLINE, "%s", msg.body);
+    mesg_write(client->to_client_fd, &hit);
+  }
+  if (fd != -1)
+    close(fd);
+  mesg_t summary = {
+    .kind = BL_FOUND,
+    .name_id = NOID,
+  };
+  snprintf(summary.body, MAXLINE, "%d of %ld messages match '%.*s'", n, total, MAXLINE - 64, terms);
+  mesg_write(client->to_client_fd, &summary);
+  SPAN_END(span, "search", n);
+}
+
 int server_handle_client(server_t *server, int idx) {
 // Process a message from the specified client. This function should
 // only be called if server_client_ready() returns true. Read a
@@ -259,9 +1212,23 @@ int server_handle_client(server_t *server, int idx) {
   client_t *client = server_get_client(server, idx);
   client->data_ready = 0;
   mesg_t msg;
-  int bytes = read(client->to_server_fd, &msg, sizeof(mesg_t));
-  check_fail(bytes != sizeof(mesg_t), 1, "a messaging error occured with client '%s'\n", client->name);
-  if (msg.kind == BL_MESG) {
+  SPAN_BEGIN(span);
+  int ret = server->uring != NULL ? uring_read_mesg(server->uring, client->id, &msg)
+          : client->held != NULL  ? server_read_held(client, &msg)
+                                  : mesg_read(client->to_server_fd, &msg);
+  SPAN_END(span, "read_mesg", idx);
+  check_fail(ret != 1, 1, "a messaging error occured with client '%s'\n", client->name);
+  server->n_handled++;
+  server_capture(server, TRACE_MESG, client->conn, &msg);
+  int requested_id = msg.name_id;
+  // never trust the sender's own idea of who it is
+  msg.name_id = client->id;
+  strncpy(msg.name, client->name, MAXNAME);
+  if (msg.kind == BL_MESG && server->search != NULL && strncmp(msg.body, "%search ", 8) == 0) {
+    server_search(server, client, msg.body + 8); //answered to the asker alone
+    log_printf("client %d '%s' SEARCH '%s'\n", idx,msg.name,msg.body + 8);
+  }
+  else if (msg.kind == BL_MESG) {
     server_broadcast(server, &msg);
     log_printf("client %d '%s' MESSAGE '%s'\n", idx,msg.name,msg.body);
   }
@@ -274,6 +1241,12 @@ int server_handle_client(server_t *server, int idx) {
     client->last_contact_time = server->time_sec;
     log_printf("client %d '%s' PINGED\n", idx,msg.name);
   }
+  else if (msg.kind == BL_NAMEMAP) {
+    char *subject = server_find_id(server, requested_id);
+    if (subject != NULL)
+      server_send_namemap(server, client, requested_id, subject);
+    dbg_printf("client %d '%s' asked for id %d\n", idx, msg.name, requested_id);
+  }
   log_printf("END: server_handle_client()\n");
   return 0;
 }
@@ -282,12 +1255,16 @@ void server_tick(server_t *server){
   server->time_sec++;
   server->time_sec %= 1000; //so that the integer will never overflow. 
                             //doesn't interfere with timeout calculations.
+  server_capture(server, TRACE_TICK, -1, NULL);
+  server_capture_flush(server); //a crash loses at most a second of the trace
+  server_log_seal(server);      //and readers of a BL_LOGZ log lag by at most a second
 }
 
 void server_ping_clients(server_t *server) {
 // ADVANCED: Ping all clients in the server by broadcasting a ping.
   mesg_t msg = {
-    .kind = BL_PING
+    .kind = BL_PING,
+    .name_id = NOID,
   };
   server_broadcast(server, &msg);
 }
@@ -304,7 +1281,8 @@ void server_remove_disconnected(server_t *server, int disconnect_secs) {
     client_t *cur = server_get_client(server, i);
     if (server->time_sec - cur->last_contact_time >= disconnect_secs) {
       mesg_t msg = {
-        .kind = BL_DISCONNECTED
+        .kind = BL_DISCONNECTED,
+        .name_id = cur->id,
       };
       strncpy(msg.name,cur->name,MAXNAME);
       server_remove_client(server, i);
@@ -325,21 +1303,223 @@ void server_write_who(server_t *server) {
 // using the pwrite() function to write to a specific location in an
 // open file descriptor which will not alter the position of log_fd so
 // that appends continue to write to the end of the file.
+  SPAN_BEGIN(span);
   who_t who = {
     .n_clients = server->n_clients
   };
   for (int i = 0; i < server->n_clients; i++) {
     snprintf(who.names[i],MAXNAME+1,"%s",server_get_client(server, i)->name);
   }
+  if (server->fed != NULL) //everyone in the federated room, whichever server they are on
+    who.n_clients = fed_members(server->fed, who.names); //the main thread may be changing them
   sem_wait(server->log_sem);
   int bytes = pwrite(server->log_fd, &who, sizeof(who_t), 0);
   check_fail(bytes != sizeof(who_t), 1, "a status logging error occured\n");
   sem_post(server->log_sem);
+  SPAN_END(span, "write_who", who.n_clients);
 }
 
-void server_log_message(server_t *server, mesg_t *mesg) {
+static void server_logz_record(server_t *server, mesg_t *mesg, msgbuf_t *buf) {
+// ADVANCED: Add the record for mesg, encoded in buf, to the BL_LOGZ
+// block, sealing the block once it is full. The first record of each
+// session id in the block enters the id's name in the block's
+// dictionary unless it is a BL_JOINED which names it itself.
+  logz_t *z = server->logz;
+  long start = clock_usec();
+  int len = buf->len;
+  memcpy(z->raw + LOGZ_DICT + z->len, buf->data, len);
+  int id = mesg->name_id;
+  if (id >= 0 && id < MAXCLIENTS && !z->named[id]) {
+    z->named[id] = 1;
+    snprintf(z->names[id], MAXNAME, "%s", mesg->kind == BL_JOINED ? "" : mesg->name);
+  }
+  if (mesg->seq != 0 && z->first_seq == 0)
+    z->first_seq = mesg->seq;
+  if (mesg->seq != 0)
+    z->last_seq = mesg->seq;
+  z->len += len;
+  server->log_records++;
+  server->log_bytes += len;
+  server->log_usec += clock_usec() - start;
+  if (z->len >= LOGZ_BLOCK)
+    server_log_seal(server);
+}
+
+static void server_log_record(server_t *server, char *wire, int len) {
+// ADVANCED: Append one encoded record to the log and note it as the
+// latest verified record.
+  long start = clock_usec();
+  wire_t hdr;
+  memcpy(&hdr, wire, sizeof(wire_t));
+  server_log_write(server, wire, len);
+  server->ckpt.last_off = server->ckpt.valid_off;
+  server->ckpt.last_crc = hdr.crc;
+  server->ckpt.valid_off += len;
+  if (hdr.seq > server->ckpt.last_seq)
+    server->ckpt.last_seq = hdr.seq;
+  server->log_records++;
+  server->log_bytes += len;
+  server->log_stored += len;
+  server->log_usec += clock_usec() - start;
+}
+
+void server_log_message(server_t *server, mesg_t *mesg, msgbuf_t *buf) {
 // ADVANCED: Write the given message to the end of log file associated
-// with the server.
-  int bytes = write(server->log_fd, mesg, sizeof(mesg_t));
-  check_fail(bytes != sizeof(mesg_t), 1, "a record logging error occured\n");
-}
\ No newline at end of file
+// with the server. Records use the same compact encoding as the FIFOs
+// so names are only spelled out by BL_JOINED records, and the record
+// is the copy of the message in buf which was sent to clients.
+//
+// Every INDEX_BYTES of log a BL_SNAPSHOT naming all connected clients
+// is written first and added to the index, so readers can start at
+// any index entry rather than at the beginning of the log. Under
+// BL_LOGZ records are gathered into compressed blocks instead, each
+// of which is indexed and carries the names it needs.
+//
+// Chat messages are also handed to the %search index, if there is one,
+// along with where reading the log will find them.
+  SPAN_BEGIN(span);
+  if (server->logz != NULL) {
+    if (server->search != NULL && mesg->kind == BL_MESG)
+      search_add(server->search, mesg, server->ckpt.valid_off); //where the block will go
+    server_logz_record(server, mesg, buf);
+    SPAN_END(span, "log_message", buf->len);
+    return;
+  }
+  long last_index = server->ckpt.n_index ? server->index[server->ckpt.n_index-1].off : 0;
+  if (server->ckpt.valid_off - last_index >= INDEX_BYTES) {
+    server_index_add(server, server->ckpt.last_seq, server->ckpt.valid_off);
+    mesg_t snap = {
+      .kind = BL_SNAPSHOT,
+      .name_id = NOID,
+    };
+    char wire[MAXWIRE];
+    server_log_record(server, wire, mesg_encode(&snap, wire));
+    for (int id = 0; id < MAXCLIENTS; id++) {
+      char *name = server_find_id(server, id);
+      if (name == NULL)
+        continue;
+      mesg_t map = {
+        .kind = BL_NAMEMAP,
+        .name_id = id,
+      };
+      snprintf(map.name, MAXNAME, "%s", name);
+      server_log_record(server, wire, mesg_encode(&map, wire));
+    }
+  }
+  if (server->search != NULL && mesg->kind == BL_MESG)
+    search_add(server->search, mesg, server->ckpt.valid_off);
+  server_log_record(server, buf->data, buf->len);
+  SPAN_END(span, "log_message", buf->len);
+}
+
+void server_checkpoint(server_t *server) {
+// ADVANCED: Save the sequence number, verified length and index of
+// the log to "server_name.ckpt" so that the next server_start() only
+// has to verify what was appended after this point. Records gathered
+// under BL_LOGZ are sealed into a block first.
+  SPAN_BEGIN(span);
+  server_log_seal(server);
+  log_write_checkpoint(server->server_name, &server->ckpt, server->index);
+  if (server->search != NULL)
+    search_save_later(server->search);
+  SPAN_END(span, "checkpoint", server->ckpt.n_index);
+}
+
+// catchup_t: state while streaming missed messages to one client
+typedef struct {
+  int fd;                       // to_client_fd of the client catching up
+  char buf[CATCHUP_BUF];        // pending bytes not yet written
+  int len;                      // number of pending bytes in buf
+  nametab_t told;               // names already announced during this catch-up
+  int count;                    // number of missed messages sent
+} catchup_t;
+
+static void catchup_flush(catchup_t *cu) {
+// Write out all bytes pending for the client catching up.
+  if (cu->len == 0)
+    return;
+  int bytes = write(cu->fd, cu->buf, cu->len);
+  check_fail(bytes != cu->len, 1, "an issue catching up a client occurred\n");
+  cu->len = 0;
+}
+
+static void catchup_append(catchup_t *cu, char *wire, int len) {
+// Queue encoded bytes for the client, writing out a full buffer first.
+  if (cu->len + len > CATCHUP_BUF)
+    catchup_flush(cu);
+  memcpy(cu->buf + cu->len, wire, len);
+  cu->len += len;
+}
+
+static void catchup_push(catchup_t *cu, char *name, char *wire, int len) {
+// Queue one missed message. Session ids are reused so the message is
+// preceded by a BL_NAMEMAP whenever its id named someone else before.
+  wire_t hdr;
+  memcpy(&hdr, wire, sizeof(wire_t));
+  int id = hdr.name_id;
+  if (id >= 0 && id < MAXCLIENTS && strcmp(cu->told.names[id], name) != 0) {
+    mesg_t map = {
+      .kind = BL_NAMEMAP,
+      .name_id = id,
+    };
+    snprintf(map.name, MAXNAME, "%s", name);
+    snprintf(cu->told.names[id], MAXNAME, "%s", name);
+    char buf[MAXWIRE];
+    catchup_append(cu, buf, mesg_encode(&map, buf));
+  }
+  catchup_append(cu, wire, len);
+  cu->count++;
+}
+
+int server_catch_up(server_t *server, client_t *client, long last_seq) {
+// Send a rejoining client every broadcast it missed after last_seq in
+// as few writes as possible. Messages still in the server's window
+// are sent from memory; ADVANCED: older ones are read back from the
+// log. Returns the number of missed messages sent.
+  SPAN_BEGIN(span);
+  catchup_t *cu = malloc(sizeof(catchup_t));
+  check_fail(cu == NULL, 1, "couldn't allocate catch-up buffer\n");
+  cu->fd = client->to_client_fd;
+  cu->len = 0;
+  cu->count = 0;
+  nametab_init(&cu->told);
+
+  long lo = server->seq - WINDOW + 1; //oldest message still in the window
+  if (lo < server->window_first)
+    lo = server->window_first;
+
+  if (DO_ADVANCED && last_seq + 1 < lo) {
+    server_log_seal(server); //missed messages may still be gathered for a BL_LOGZ block
+    char logname[MAXPATH+4];
+    snprintf(logname, MAXPATH+4, "%s.log", server->server_name);
+    int fd = open(logname, O_RDONLY);
+    check_fail(fd == -1, 1, "couldn't open logfile %s\n", logname);
+    nametab_t *names = malloc(sizeof(nametab_t));
+    check_fail(names == NULL, 1, "couldn't allocate a name table\n");
+    nametab_init(names);
+    logscan_t scan;
+    logscan_open(&scan, fd, log_index_find(server->index, server->ckpt.n_index, last_seq));
+    mesg_t msg;
+    while (logscan_next(&scan, &msg) == 1 && msg.seq < lo) {
+      nametab_resolve(names, &msg);
+      if (msg.seq > last_seq) {
+        char buf[MAXWIRE];
+        catchup_push(cu, msg.name, buf, mesg_encode(&msg, buf));
+      }
+    }
+    logscan_close(&scan);
+    free(names);
+    close(fd);
+  }
+
+  for (long seq = last_seq + 1 > lo ? last_seq + 1 : lo; seq <= server->seq; seq++) {
+    window_t *slot = server_window_slot(server, seq);
+    if (slot != NULL)
+      catchup_push(cu, slot->name, slot->buf->data, slot->buf->len);
+  }
+  catchup_flush(cu);
+  int count = cu->count;
+  free(cu);
+  SPAN_END(span, "catch_up", count);
+  return count;
+}
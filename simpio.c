@@ -95,6 +95,91 @@ void simpio_get_char(simpio_t *simpio){
   }
 }
 
+// Switch simpio to bulk mode if BL_BULK is set in the environment, for
+// input from a file or another program piped in. Bulk mode reads
+// input with simpio_get_lines() rather than simpio_get_char(). Returns
+// 1 if bulk mode is on.
+int simpio_detect_bulk(simpio_t *simpio){
+  simpio->bulk = getenv("BL_BULK") != NULL;
+  simpio->chunk_pos = 0;
+  simpio->chunk_len = 0;
+  return simpio->bulk;
+}
+
+// Copy the len bytes at start into line as a string, cutting it to
+// MAXLINE-1 characters as typed input is.
+static void simpio_take_line(char *line, char *start, int len){
+  if(len > MAXLINE-1){
+    len = MAXLINE-1;
+  }
+  memcpy(line, start, len);
+  line[len] = '\0';
+}
+
+// Split up to max complete lines buffered in chunk into lines,
+// skipping empty ones. Returns the number of lines placed in lines.
+static int simpio_split_lines(simpio_t *simpio, char lines[][MAXLINE], int max){
+  int n = 0;
+  while(n < max){
+    char *start = simpio->chunk + simpio->chunk_pos;
+    char *newline = memchr(start, '\n', simpio->chunk_len - simpio->chunk_pos);
+    if(newline == NULL){
+      break;
+    }
+    simpio->chunk_pos += newline - start + 1;
+    if(newline > start){
+      simpio_take_line(lines[n++], start, newline - start);
+    }
+  }
+  return n;
+}
+
+// Returns 1 if bulk mode has a complete line buffered which
+// simpio_get_lines() will hand over without reading, as happens when
+// more than a batch of lines arrived in one chunk.
+int simpio_has_line(simpio_t *simpio){
+  return simpio->bulk &&
+    memchr(simpio->chunk + simpio->chunk_pos, '\n', simpio->chunk_len - simpio->chunk_pos) != NULL;
+}
+
+// Bulk mode counterpart to simpio_get_char(). Places up to max
+// complete lines of input in lines, reading a chunk of up to
+// SIMPIO_CHUNK bytes only if none are buffered. Like simpio_get_char()
+// it reads at most once, so it suits a poll() loop. Nothing is echoed
+// and empty lines are skipped. At the end of input, end_of_input is
+// set and a final line with no newline is still handed over. Returns
+// the number of lines placed in lines, 0 if the input read so far
+// does not complete a line.
+int simpio_get_lines(simpio_t *simpio, char lines[][MAXLINE], int max){
+  int n = simpio_split_lines(simpio, lines, max);
+  if(n > 0 || simpio->end_of_input){
+    return n;
+  }
+  int left = simpio->chunk_len - simpio->chunk_pos;     // shift down a partial line
+  memmove(simpio->chunk, simpio->chunk + simpio->chunk_pos, left);
+  simpio->chunk_pos = 0;
+  simpio->chunk_len = left;
+  if(left == SIMPIO_CHUNK){                             // a line longer than the chunk
+    simpio_take_line(lines[0], simpio->chunk, left);
+    simpio->chunk_len = 0;
+    return 1;
+  }
+  int bytes = read(fileno(simpio->infile), simpio->chunk + left, SIMPIO_CHUNK - left);
+  if(bytes == -1 && errno == EINTR){
+    return 0;
+  }
+  if(bytes <= 0){                                       // end of input
+    if(left > 0){
+      simpio_take_line(lines[n++], simpio->chunk, left);
+    }
+    simpio->chunk_len = 0;
+    simpio->end_of_input = 1;
+    return n;
+  }
+  simpio->chunk_len += bytes;
+  return simpio_split_lines(simpio, lines, max);
+}
+
 // Print like printf but move the input prompt ahead and preserve the
 // input that has been typed so far along with the prompt.
 void iprintf(simpio_t *simpio, char *fmt, ...){
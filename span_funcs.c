@@ -0,0 +1,151 @@
+#include "blather.h"
+#include <sys/syscall.h>
+
+// Phase spans: timings of each phase of the server's loop and of its
+// handlers, for finding where a pass spends its time. Built in by
+// 'make SPANS=1' (after a 'make clean') and switched on by naming a
+// file in BL_SPANS, e.g.
+//
+//   BL_SPANS=server.json ./bl_server server
+//
+// Each thread records into a ring of its own holding its last
+// SPAN_RING spans, so recording takes no lock: two clock reads and a
+// store. The rings are written to the file as Chrome trace-event JSON,
+// which chrome://tracing or ui.perfetto.dev displays as a timeline,
+// when the server shuts down and whenever it is sent SIGUSR1.
+//
+// Threads such as the who writer come and go; a ring outlives its
+// thread and is taken over by the next thread that starts, keeping
+// the spans recorded before, so there are only ever as many rings as
+// threads running at once. The threads which owned a ring never ran
+// at the same time, so the trace shows all of its spans as one thread,
+// under the name and id of the latest.
+
+typedef struct spanring {
+  span_t spans[SPAN_RING];
+  long n;                       // spans ever recorded; the latest is spans[(n-1) % SPAN_RING]
+  int busy;                     // a live thread owns the ring
+  int tid;                      // the thread which last owned it
+  char name[32];                // and its name in the trace
+  struct spanring *next;        // next ring on span_rings
+} spanring_t;
+
+int span_on = 0;                // set by span_open() if BL_SPANS names a file
+
+static char span_file[MAXPATH];
+static pthread_mutex_t span_lock = PTHREAD_MUTEX_INITIALIZER;
+static spanring_t *span_rings;  // every ring made, under span_lock
+static pthread_key_t span_key;  // releases a thread's ring when it exits
+static __thread spanring_t *my_ring;
+
+static void span_release(void *ring) {
+// Free a ring for the next thread to start, run as its owner exits.
+  __atomic_store_n(&((spanring_t *) ring)->busy, 0, __ATOMIC_RELEASE);
+}
+
+static spanring_t *span_ring(void) {
+// This thread's ring, taking a free one or making one on first use.
+  if (my_ring != NULL)
+    return my_ring;
+  pthread_mutex_lock(&span_lock);
+  spanring_t *ring = span_rings;
+  while (ring != NULL && __atomic_load_n(&ring->busy, __ATOMIC_ACQUIRE))
+    ring = ring->next;
+  if (ring == NULL) {
+    ring = calloc(1, sizeof(spanring_t));
+    check_fail(ring == NULL, 1, "couldn't allocate a span ring\n");
+    ring->next = span_rings;
+    span_rings = ring;
+  }
+  ring->busy = 1;
+  ring->tid = syscall(SYS_gettid);
+  snprintf(ring->name, sizeof(ring->name), "thread %d", ring->tid);
+  pthread_mutex_unlock(&span_lock);
+  pthread_setspecific(span_key, ring);
+  my_ring = ring;
+  return ring;
+}
+
+void span_open(void) {
+// Start recording spans if BL_SPANS names a file to dump them to.
+// Called once, before any other thread starts.
+  char *file = getenv("BL_SPANS");
+  if (file == NULL || *file == '\0')
+    return;
+  snprintf(span_file, MAXPATH, "%s", file);
+  pthread_key_create(&span_key, span_release);
+  span_on = 1;
+  span_thread("main loop");
+}
+
+long span_now(void) {
+// Nanoseconds on the monotonic clock, read through the vDSO without
+// entering the kernel.
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void span_record(const char *name, long start, int arg) {
+// Record a span named name, a string constant, which began at start
+// and ends now.
+  spanring_t *ring = span_ring();
+  span_t *span = &ring->spans[ring->n % SPAN_RING];
+  span->name = name;
+  span->start = start;
+  span->end = span_now();
+  span->arg = arg;
+  __atomic_store_n(&ring->n, ring->n + 1, __ATOMIC_RELEASE);
+}
+
+void span_thread(const char *name) {
+// Name the calling thread in the trace.
+  spanring_t *ring = span_ring();
+  pthread_mutex_lock(&span_lock);
+  snprintf(ring->name, sizeof(ring->name), "%s", name);
+  pthread_mutex_unlock(&span_lock);
+}
+
+void span_dump(void) {
+// Write the spans in every ring to the BL_SPANS file as Chrome
+// trace-event JSON, replacing what an earlier dump wrote. Other
+// threads go on recording meanwhile; a span overwritten while it was
+// being copied is left out.
+  char tmp[MAXPATH+8];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", span_file);
+  FILE *out = fopen(tmp, "w");
+  if (out == NULL) {
+    log_printf("couldn't write spans to '%s'\n", tmp);
+    return;
+  }
+  int pid = getpid();
+  long written = 0;
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"bl_server\"}}", pid);
+  pthread_mutex_lock(&span_lock);
+  for (spanring_t *ring = span_rings; ring != NULL; ring = ring->next) {
+    fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            pid, ring->tid, ring->name);
+    long n = __atomic_load_n(&ring->n, __ATOMIC_ACQUIRE);
+    for (long i = n > SPAN_RING ? n - SPAN_RING : 0; i < n; i++) {
+      span_t span = ring->spans[i % SPAN_RING];
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&ring->n, __ATOMIC_ACQUIRE) > i + SPAN_RING - 1)
+        continue;               // its slot was reused while copying
+      fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%ld.%03ld,\"dur\":%ld.%03ld",
+              span.name, pid, ring->tid, span.start / 1000, span.start % 1000,
+              (span.end - span.start) / 1000, (span.end - span.start) % 1000);
+      if (span.arg >= 0)
+        fprintf(out, ",\"args\":{\"arg\":%d}", span.arg);
+      fprintf(out, "}");
+      written++;
+    }
+  }
+  pthread_mutex_unlock(&span_lock);
+  fprintf(out, "\n]}\n");
+  if (fclose(out) != 0 || rename(tmp, span_file) != 0) {
+    log_printf("couldn't write spans to '%s'\n", span_file);
+    return;
+  }
+  dbg_printf("wrote %ld spans to '%s'\n", written, span_file);
+}
@@ -0,0 +1,62 @@
+#!/bin/bash
+#
+# Test of bl_client's bulk input mode (BL_BULK). A sender pipes lines
+# into a client in bulk mode and a receiver, reading typed input the
+# interactive way, must see every one of them in order:
+#
+# - more lines than one batch (SIMPIO_BATCH) while the sender keeps its
+#   end of the pipe open, so nothing but the lines already buffered
+#   can move the client along
+# - a few lines followed by the end of input, the last with no newline
+#
+# usage: ./test_bulk.sh [lines]
+
+lines=${1:-200}
+server="test-bulk-serv"
+dir="test-results"
+fail=0
+
+mkdir -p $dir
+cd $dir
+rm -f ${server}.* bulk-*.out
+
+function check () {                        # check <label> <expected lines> <output file>
+    got=$(grep -c '\[tx\] : line ' $3)
+    want=$(seq 1 $2 | sed 's/^/line /')
+    if [ "$got" = "$2" ] && [ "$(grep -o 'line [0-9]*$' $3)" = "$want" ]; then
+        printf "bulk input: %s: %d of %d lines received in order\n" "$1" $got $2
+    else
+        printf "bulk input: %s: %d of %d lines received, FAIL\n" "$1" $got $2
+        fail=1
+    fi
+}
+
+../bl_server $server > ${server}.out 2>&1 & server_pid=$!
+sleep 0.2
+
+(sleep 4) | ../bl_client $server rx > bulk-rx1.out 2>&1 & rx_pid=$!
+sleep 0.2
+(seq 1 $lines | sed 's/^/line /'; sleep 2) | BL_BULK=1 ../bl_client $server tx > /dev/null 2>&1 &
+sleep 1                                    # the sender's pipe is still open
+check "burst with the pipe open" $lines bulk-rx1.out
+wait $rx_pid
+
+(sleep 2) | ../bl_client $server rx > bulk-rx2.out 2>&1 & rx_pid=$!
+sleep 0.2
+printf "line 1\nline 2\nline 3" | BL_BULK=1 ../bl_client $server tx > /dev/null 2>&1
+sleep 0.5
+check "lines then end of input" 3 bulk-rx2.out
+if ! grep -q -- '-- tx DEPARTED --' bulk-rx2.out; then
+    printf "bulk input: sender did not depart at the end of input, FAIL\n"
+    fail=1
+fi
+wait $rx_pid
+
+kill $server_pid
+wait $server_pid
+rm -f ${server}.*
+if [ "$fail" = "0" ]; then
+    rm -f bulk-*.out
+    printf "ALL OK\n"
+fi
+exit $fail
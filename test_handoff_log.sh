@@ -0,0 +1,71 @@
+#!/bin/bash
+#
+# Test of the log across a handoff from an io_uring server to a poll()
+# one. The io_uring server writes records at their offsets, leaving
+# the log's file position where recovery put it, so the poll() server
+# taking over must append at the end of the log rather than there:
+#
+# - messages are logged by a server under BL_IO=uring
+# - SIGHUP hands off to a server which sets BL_IO=poll before starting
+# - more messages are logged, and bl_showlog must see all of them
+#
+# Skipped, with ALL OK, where io_uring is unavailable.
+#
+# usage: ./test_handoff_log.sh [lines]
+
+lines=${1:-20}
+server="test-handoff-serv"
+dir="test-results"
+fail=0
+
+mkdir -p $dir
+cd $dir
+rm -f ${server}.* handoff-*.out handoff-wrap
+
+# the binary the handoff execs: the real server under BL_IO=poll, with
+# argv[0] kept so it execs this wrapper again on a later SIGHUP
+cat > handoff-wrap <<EOF
+#!/bin/bash
+[ -n "\$BL_HANDOFF" ] && export BL_IO=poll
+exec -a "\$0" $(cd .. && pwd)/bl_server "\$@"
+EOF
+chmod u+rx handoff-wrap
+
+function send () {                         # send <name> <first> <last>
+    (seq $2 $3 | sed 's/^/line /'; sleep 0.3) | ../bl_client $server $1 > /dev/null 2>&1
+}
+
+BL_ADVANCED=1 BL_IO=uring ./handoff-wrap $server > handoff-serv.out 2>&1 & server_pid=$!
+sleep 0.3
+if grep -q 'io_uring is unavailable' handoff-serv.out; then
+    kill $server_pid
+    wait $server_pid
+    rm -f ${server}.* handoff-*.out handoff-wrap
+    printf "handoff log: io_uring is unavailable, skipped\n"
+    printf "ALL OK\n"
+    exit 0
+fi
+
+send before 1 $lines
+kill -HUP $server_pid
+sleep 0.3
+send after $((lines+1)) $((2*lines))
+kill $server_pid
+wait $server_pid
+
+../bl_showlog --kind mesg ${server}.log > handoff-log.out 2>&1
+got=$(grep -o 'line [0-9]*$' handoff-log.out)
+want=$(seq 1 $((2*lines)) | sed 's/^/line /')
+if [ "$got" = "$want" ]; then
+    printf "handoff log: %d of %d messages logged in order\n" $((2*lines)) $((2*lines))
+else
+    printf "handoff log: %d of %d messages logged, FAIL\n" $(echo -n "$got" | grep -c .) $((2*lines))
+    fail=1
+fi
+
+rm -f ${server}.*
+if [ "$fail" = "0" ]; then
+    rm -f handoff-*.out handoff-wrap
+    printf "ALL OK\n"
+fi
+exit $fail
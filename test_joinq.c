@@ -0,0 +1,93 @@
+#include "blather.h"
+#include <sys/wait.h>
+
+// Stress test of the shared memory join queue: many processes join at
+// the same moment, more of them than the queue has slots, while this
+// process consumes requests the way bl_server does. Every request
+// must arrive exactly once.
+//
+// usage: test_joinq [processes] [joins per process]
+
+int main(int argc, char **argv) {
+  int n_procs = argc > 1 ? atoi(argv[1]) : 64;
+  int n_joins = argc > 2 ? atoi(argv[2]) : 100;
+  char server_name[MAXPATH];
+  snprintf(server_name, MAXPATH, "test-joinq-%d", getpid());
+  char fifo_name[MAXPATH+5];
+  snprintf(fifo_name, MAXPATH+5, "%s.fifo", server_name);
+  unlink(fifo_name);
+  check_fail(mkfifo(fifo_name, S_IRUSR | S_IWUSR) == -1, 1, "couldn't create %s\n", fifo_name);
+  int bellfd = open(fifo_name, O_RDWR | O_NONBLOCK);
+  check_fail(bellfd == -1, 1, "couldn't open %s\n", fifo_name);
+  joinq_t *q = joinq_create(server_name);
+  check_fail(q == NULL, 1, "couldn't create join queue\n");
+
+  // children block on the start pipe so that they all join at once
+  int start[2];
+  check_fail(pipe(start) == -1, 1, "couldn't create start pipe\n");
+  for (int p = 0; p < n_procs; p++) {
+    pid_t pid = fork();
+    check_fail(pid == -1, 1, "couldn't fork\n");
+    if (pid == 0) {
+      close(start[1]);
+      char c;
+      check_fail(read(start[0], &c, 1) != 0, 0, "start pipe should only close\n");
+      for (int j = 0; j < n_joins; j++) {
+        joinrec_t rec = { .last_seq = j };
+        snprintf(rec.name, MAXNAME, "proc%d", p);
+        snprintf(rec.fifo_prefix, JOINQ_PREFIX, "%d.%d", p, j);
+        check_fail(joinq_join(server_name, &rec) != 0, 1, "process %d couldn't join\n", p);
+      }
+      exit(0);
+    }
+  }
+  close(start[0]);
+  long begin = clock_usec();
+  close(start[1]);
+
+  int *seen = calloc(n_procs * n_joins, sizeof(int));
+  check_fail(seen == NULL, 1, "couldn't allocate\n");
+  long total = (long) n_procs * n_joins, received = 0, bad = 0, batches = 0;
+  struct pollfd pfd = { .fd = bellfd, .events = POLLIN };
+  while (received < total && clock_usec() - begin < 60000000L) {
+    if (poll(&pfd, 1, 100) <= 0)
+      continue;
+    char bells[PIPE_BUF];
+    while (read(bellfd, bells, PIPE_BUF) == PIPE_BUF)
+      ;
+    joinrec_t rec;
+    batches++;
+    while (joinq_pop(q, &rec)) {
+      int p, j;
+      if (sscanf(rec.fifo_prefix, "%d.%d", &p, &j) != 2 || p < 0 || p >= n_procs || j < 0 || j >= n_joins
+          || rec.last_seq != j || atoi(rec.name + 4) != p) {
+        bad++;
+        continue;
+      }
+      seen[p * n_joins + j]++;
+      received++;
+    }
+  }
+  long usec = clock_usec() - begin;
+  for (int p = 0; p < n_procs; p++)
+    wait(NULL);
+
+  long lost = 0, dups = 0;
+  for (long i = 0; i < total; i++) {
+    if (seen[i] == 0)
+      lost++;
+    if (seen[i] > 1)
+      dups += seen[i] - 1;
+  }
+  printf("joinq stress: %d processes x %d joins: %ld received in %ld batches, %ld lost, %ld duplicated, %ld malformed in %.3f s\n",
+         n_procs, n_joins, received, batches, lost, dups, bad, usec / 1e6);
+
+  free(seen);
+  joinq_close(q);
+  joinq_unlink(server_name);
+  close(bellfd);
+  unlink(fifo_name);
+  int ok = lost == 0 && dups == 0 && bad == 0;
+  printf("%s\n", ok ? "ALL OK" : "FAIL");
+  return ok ? 0 : 1;
+}
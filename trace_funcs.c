@@ -0,0 +1,30 @@
+#include "blather.h"
+
+// A capture trace, written by bl_server when BL_CAPTURE names a file
+// and read by bl_replay, is a tracehdr_t followed by events. Each
+// event is a trace_t and, for joins and client messages, the message
+// in the same wire format clients and the log use.
+
+// Encode the event rec, with mesg for TRACE_JOIN and TRACE_MESG events
+// or NULL for others, into buf. Returns the number of bytes used.
+int trace_encode(trace_t *rec, mesg_t *mesg, char buf[MAXTRACE]) {
+  memcpy(buf, rec, sizeof(trace_t));
+  if (mesg == NULL)
+    return sizeof(trace_t);
+  return sizeof(trace_t) + mesg_encode(mesg, buf + sizeof(trace_t));
+}
+
+// Decode a single event from the len bytes at buf into rec and, for
+// events which carry one, mesg. Returns the number of bytes consumed,
+// 0 if buf does not hold a whole event and -1 if it is malformed.
+int trace_decode(char *buf, int len, trace_t *rec, mesg_t *mesg) {
+  if (len < sizeof(trace_t))
+    return 0;
+  memcpy(rec, buf, sizeof(trace_t));
+  if (rec->event == TRACE_TICK)
+    return sizeof(trace_t);
+  if (rec->event != TRACE_JOIN && rec->event != TRACE_MESG)
+    return -1;
+  int ret = mesg_decode(buf + sizeof(trace_t), len - sizeof(trace_t), mesg);
+  return ret <= 0 ? ret : sizeof(trace_t) + ret;
+}
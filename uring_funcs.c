@@ -0,0 +1,356 @@
+#include "blather.h"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+
+// Kinds of requests, kept in the top bits of an sqe's user_data
+#define UD_JOIN   1UL           // poll of the join FIFO
+#define UD_READ   2UL           // read posted on a client's to_server FIFO
+#define UD_WRITE  3UL           // write of a broadcast to a client or of the log
+#define UD_CANCEL 4UL           // cancellation of a posted read
+#define UD_TIMEOUT 5UL          // timeout bounding a wait
+
+#define UD(kind, id, len) ((kind) << 56 | (unsigned long) (id) << 32 | (unsigned int) (len))
+#define UD_KIND(ud) ((ud) >> 56)
+#define UD_ID(ud) ((int) (((ud) >> 32) & 0xffffff))
+
+// uring_t: an io_uring instance and the buffers its requests point at
+struct uring {
+  int fd;                       // io_uring file descriptor
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+  struct io_uring_sqe *sqes;    // submission queue entries
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;    // completion queue entries
+  void *sq_map, *cq_map;        // mmapped rings
+  size_t sq_map_len, cq_map_len, sqes_len;
+  unsigned to_submit;           // sqes filled in since the last io_uring_enter()
+  int in_flight;                // writes submitted but not yet completed
+  struct {
+    int fd;
+    char *buf;                  // bytes not yet written
+    int len;
+    long off;                   // offset written at, -1 for the current position
+  } writes[MAXCLIENTS + 1];     // writes queued since the last uring_flush(), by the id in their user_data
+  int n_writes;
+  int failed;                   // set if a write completed short
+  int join_armed;               // flag: a poll is posted on the join FIFO
+  int timeout_armed;            // flag: a timeout is posted
+  int join_ready;               // flag: the join FIFO became readable
+  int read_fd[MAXCLIENTS];      // to_server_fd by session id, -1 if not watched
+  int read_posted[MAXCLIENTS];  // flag: a read is in flight for the session id
+  int read_start[MAXCLIENTS];   // offset of the first unconsumed byte of read_buf
+  int read_len[MAXCLIENTS];     // number of bytes in read_buf
+  char read_buf[MAXCLIENTS][URING_RBUF]; // bytes read from each client
+  char *log_buf;                // log records waiting for the next flush
+  int log_len;                  // number of bytes in log_buf
+  int log_fd;                   // log the records are appended to
+  long log_off;                 // offset in the log of log_buf[0]
+  long enters;                  // number of io_uring_enter() calls made
+};
+
+static int uring_enter(uring_t *u, unsigned min_complete) {
+  unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+  int ret = syscall(__NR_io_uring_enter, u->fd, u->to_submit, min_complete, flags, NULL, 0);
+  u->enters++;
+  if (ret >= 0)
+    u->to_submit -= ret;
+  return ret;
+}
+
+static void uring_prep(uring_t *u, int op, int fd, void *addr, unsigned len, long off, unsigned long ud) {
+// Fill in and queue the next sqe, submitting what is queued if the
+// submission ring is full.
+  unsigned tail = *u->sq_tail;
+  if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= *u->sq_entries)
+    uring_enter(u, 0);
+  unsigned idx = tail & *u->sq_mask;
+  struct io_uring_sqe *sqe = u->sqes + idx;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long) addr;
+  sqe->len = len;
+  sqe->off = off;
+  sqe->user_data = ud;
+  if (op == IORING_OP_POLL_ADD)
+    sqe->poll32_events = POLLIN;
+  u->sq_array[idx] = idx;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  u->to_submit++;
+}
+
+static void uring_harvest(uring_t *u) {
+// Process every completion waiting in the completion ring.
+  unsigned head = *u->cq_head;
+  unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = u->cqes + (head & *u->cq_mask);
+    unsigned long ud = cqe->user_data;
+    int id = UD_ID(ud);
+    switch (UD_KIND(ud)) {
+      case UD_JOIN:
+        u->join_armed = 0;
+        if (cqe->res > 0)
+          u->join_ready = 1;
+        break;
+      case UD_READ:
+        u->read_posted[id] = 0;
+        if (cqe->res > 0 && u->read_fd[id] != -1)
+          u->read_len[id] += cqe->res;
+        break;
+      case UD_WRITE:
+        if (cqe->res > 0 && cqe->res < u->writes[id].len) {
+          // a large batch may only partly fit in a client's FIFO; write the rest
+          u->writes[id].buf += cqe->res;
+          u->writes[id].len -= cqe->res;
+          if (u->writes[id].off != -1)
+            u->writes[id].off += cqe->res;
+          uring_prep(u, IORING_OP_WRITE, u->writes[id].fd, u->writes[id].buf, u->writes[id].len,
+                     u->writes[id].off, UD(UD_WRITE, id, 0));
+          break;
+        }
+        u->in_flight--;
+        if (cqe->res != u->writes[id].len)
+          u->failed = 1;
+        break;
+      case UD_TIMEOUT:
+        u->timeout_armed = 0;
+        break;
+    }
+  }
+  __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Set up an io_uring with room for entries requests. Returns NULL if
+// io_uring is not available so that callers can fall back to poll().
+uring_t *uring_open(int entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (fd < 0)
+    return NULL;
+  uring_t *u = calloc(1, sizeof(uring_t));
+  check_fail(u == NULL, 1, "couldn't allocate io_uring buffers\n");
+  u->fd = fd;
+  u->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sq_map = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  u->cq_map = mmap(NULL, u->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  u->log_buf = malloc(URING_LOGBUF);
+  if (u->sq_map == MAP_FAILED || u->cq_map == MAP_FAILED || u->sqes == MAP_FAILED || u->log_buf == NULL) {
+    close(fd);
+    free(u->log_buf);
+    free(u);
+    return NULL;
+  }
+  char *sq = u->sq_map, *cq = u->cq_map;
+  u->sq_head = (unsigned *) (sq + p.sq_off.head);
+  u->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  u->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  u->sq_entries = (unsigned *) (sq + p.sq_off.ring_entries);
+  u->sq_array = (unsigned *) (sq + p.sq_off.array);
+  u->cq_head = (unsigned *) (cq + p.cq_off.head);
+  u->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  u->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  for (int i = 0; i < MAXCLIENTS; i++)
+    u->read_fd[i] = -1;
+  u->log_fd = -1;
+  return u;
+}
+
+// Tear down the io_uring and free its buffers.
+void uring_close(uring_t *u) {
+  munmap(u->sqes, u->sqes_len);
+  munmap(u->cq_map, u->cq_map_len);
+  munmap(u->sq_map, u->sq_map_len);
+  close(u->fd);
+  free(u->log_buf);
+  free(u);
+}
+
+// Start keeping a read posted on the to_server FIFO of the client
+// with the given session id.
+void uring_watch_client(uring_t *u, int id, int fd) {
+  u->read_fd[id] = fd;
+  u->read_start[id] = 0;
+  u->read_len[id] = 0;
+}
+
+// Stop reading from the client with the given session id, cancelling
+// its posted read and waiting for it to finish so that the id and
+// its buffer can be reused.
+void uring_unwatch_client(uring_t *u, int id) {
+  u->read_fd[id] = -1;
+  if (u->read_posted[id]) {
+    uring_prep(u, IORING_OP_ASYNC_CANCEL, -1, (void *) UD(UD_READ, id, 0), 0, 0, UD(UD_CANCEL, id, 0));
+    while (u->read_posted[id]) {
+      if (uring_enter(u, 1) < 0 && errno != EINTR)
+        break;
+      uring_harvest(u);
+    }
+  }
+}
+
+// Wait until the join FIFO or a watched client has input. Posts a
+// poll on join_fd and a read on every watched client which has none
+// in flight, all with one io_uring_enter() which also waits. Does not
+// block if a complete message is already buffered. If timeout_usec is
+// not -1 the wait also ends after that many microseconds, sooner if a
+// timeout posted by an earlier wait is still pending. Returns 0 or -1
+// if interrupted by a signal.
+int uring_wait(uring_t *u, int join_fd, long timeout_usec) {
+  if (!u->join_armed) {
+    uring_prep(u, IORING_OP_POLL_ADD, join_fd, NULL, 0, 0, UD(UD_JOIN, 0, 0));
+    u->join_armed = 1;
+  }
+  int have_mesg = 0;
+  for (int id = 0; id < MAXCLIENTS; id++) {
+    if (u->read_fd[id] == -1)
+      continue;
+    if (uring_has_mesg(u, id))
+      have_mesg = 1;
+    if (u->read_posted[id])
+      continue;
+    if (u->read_start[id] > 0) { // nothing is reading into the buffer so it may be compacted
+      memmove(u->read_buf[id], u->read_buf[id] + u->read_start[id], u->read_len[id] - u->read_start[id]);
+      u->read_len[id] -= u->read_start[id];
+      u->read_start[id] = 0;
+    }
+    if (URING_RBUF - u->read_len[id] < MAXWIRE)
+      continue; // full of unhandled messages
+    uring_prep(u, IORING_OP_READ, u->read_fd[id], u->read_buf[id] + u->read_len[id],
+               URING_RBUF - u->read_len[id], -1, UD(UD_READ, id, 0));
+    u->read_posted[id] = 1;
+  }
+  struct __kernel_timespec ts;  // read by the kernel as the timeout is submitted
+  if (timeout_usec >= 0 && !u->timeout_armed) {
+    ts.tv_sec = timeout_usec / 1000000;
+    ts.tv_nsec = timeout_usec % 1000000 * 1000;
+    uring_prep(u, IORING_OP_TIMEOUT, -1, &ts, 1, 0, UD(UD_TIMEOUT, 0, 0));
+    u->timeout_armed = 1;
+  }
+  int ret = uring_enter(u, have_mesg || u->join_ready ? 0 : 1);
+  uring_harvest(u);
+  if (ret < 0 && errno == EINTR)
+    return -1;
+  check_fail(ret < 0, 1, "the server is having trouble with its io_uring\n");
+  return 0;
+}
+
+// Return 1 and clear the flag if the join FIFO became readable.
+int uring_join_ready(uring_t *u) {
+  int ready = u->join_ready;
+  u->join_ready = 0;
+  return ready;
+}
+
+// Returns 1 if a whole message from the given session id is buffered.
+int uring_has_mesg(uring_t *u, int id) {
+  mesg_t msg;
+  return mesg_decode(u->read_buf[id] + u->read_start[id], u->read_len[id] - u->read_start[id], &msg) != 0;
+}
+
+// Take the next buffered message of the given session id. Returns 1
+// if a message was taken, 0 if none is buffered and -1 if the bytes
+// are not a valid message.
+int uring_read_mesg(uring_t *u, int id, mesg_t *mesg) {
+  int ret = mesg_decode(u->read_buf[id] + u->read_start[id], u->read_len[id] - u->read_start[id], mesg);
+  if (ret <= 0)
+    return ret;
+  u->read_start[id] += ret;
+  return 1;
+}
+
+static void uring_queue(uring_t *u, int fd, char *buf, int len, long off) {
+// Queue a write of len bytes at buf to fd at offset off, or at its
+// current position if off is -1, to be completed by uring_flush().
+  int id = u->n_writes++;
+  u->writes[id].fd = fd;
+  u->writes[id].buf = buf;
+  u->writes[id].len = len;
+  u->writes[id].off = off;
+  uring_prep(u, IORING_OP_WRITE, fd, buf, len, off, UD(UD_WRITE, id, 0));
+  u->in_flight++;
+}
+
+// Queue a write of the len bytes of a broadcast at wire to fd. The
+// writes to all clients share the caller's buffer, which must stay
+// unchanged until uring_flush().
+void uring_queue_write(uring_t *u, int fd, char *wire, int len) {
+  uring_queue(u, fd, wire, len, -1);
+}
+
+// Append a record to be written to the log at offset off by the next
+// uring_flush(). Records must be queued in log order.
+void uring_queue_log(uring_t *u, int fd, char *wire, int len, long off) {
+  if (u->log_len + len > URING_LOGBUF)
+    uring_flush(u);
+  if (u->log_len == 0) {
+    u->log_fd = fd;
+    u->log_off = off;
+  }
+  memcpy(u->log_buf + u->log_len, wire, len);
+  u->log_len += len;
+}
+
+// Submit all queued writes, including one for pending log records,
+// with a single io_uring_enter() and wait for every one of them to
+// complete. Returns 0 if all writes completed in full and -1 if not.
+int uring_flush(uring_t *u) {
+  if (u->log_len > 0) {
+    uring_queue(u, u->log_fd, u->log_buf, u->log_len, u->log_off);
+  }
+  while (u->in_flight > 0) {
+    int ret = uring_enter(u, u->in_flight);
+    uring_harvest(u);
+    if (ret < 0 && errno != EINTR)
+      return -1;
+  }
+  u->log_len = 0;
+  u->n_writes = 0;
+  int failed = u->failed;
+  u->failed = 0;
+  return failed ? -1 : 0;
+}
+
+// Returns the number of io_uring_enter() calls made so far.
+long uring_enters(uring_t *u) {
+  return u->enters;
+}
+
+// Cancel every posted read and wait for each to finish so that no
+// more input is taken from the clients. Bytes already read stay
+// buffered for uring_buffered(). Used before handing the server's
+// clients to another process.
+void uring_quiesce(uring_t *u) {
+  for (int id = 0; id < MAXCLIENTS; id++) {
+    if (u->read_posted[id])
+      uring_prep(u, IORING_OP_ASYNC_CANCEL, -1, (void *) UD(UD_READ, id, 0), 0, 0, UD(UD_CANCEL, id, 0));
+  }
+  for (int id = 0; id < MAXCLIENTS; id++) {
+    while (u->read_posted[id]) {
+      if (uring_enter(u, 1) < 0 && errno != EINTR)
+        break;
+      uring_harvest(u);
+    }
+  }
+}
+
+// Point buf at the bytes read from the given session id which have not
+// been taken as messages yet. Returns their number.
+int uring_buffered(uring_t *u, int id, char **buf) {
+  *buf = u->read_buf[id] + u->read_start[id];
+  return u->read_len[id] - u->read_start[id];
+}
+
+// Put len bytes read from the given session id by another process
+// back in its buffer, as though this uring had read them. Call after
+// uring_watch_client().
+void uring_prefill(uring_t *u, int id, char *buf, int len) {
+  memcpy(u->read_buf[id], buf, len);
+  u->read_start[id] = 0;
+  u->read_len[id] = len;
+}
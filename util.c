@@ -69,4 +69,10 @@ void pause_for(long nanos, int secs){
     .tv_sec  = secs,
   };
   nanosleep(&tm,NULL);
-}
\ No newline at end of file
+}
+// Return the current wall clock time in microseconds since the epoch.
+long clock_usec(){
+  struct timespec tm;
+  clock_gettime(CLOCK_REALTIME, &tm);
+  return tm.tv_sec * 1000000L + tm.tv_nsec / 1000;
+}